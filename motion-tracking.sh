@@ -28,10 +28,22 @@ cat .flow-vis.pipe \
 	| recordframes --file="flow.avi" \
 > /dev/null &
 
-#videosource "$INPUT_SOURCE" $INPUT_OPTIONS \
-screensource --scale=0.5 \
-	| tee .bg.pipe \
-	| opticalflow --winsize=20 --visualize --visualize-out=.flow-vis.pipe --scale=$FLOW_SCALE \
+# the background branch may drop frames if the tracker falls behind, the flow branch gets every frame
+#videosource "$INPUT_SOURCE" $INPUT_OPTIONS --pyramid=4 --output=.bg.pipe:drop,/dev/stdout \
+#screensource --scale=0.5 --output=.bg.pipe:drop,/dev/stdout \
+x11source --scale=0.5 --elide-repeats=1 --output=.bg.pipe:drop,/dev/stdout \
+	| opticalflow --winsize=20 --visualize --visualize-out=.flow-vis.pipe:drop --scale=$FLOW_SCALE --flow-format=int16 \
 > .flow.pipe
 
+# on a fixed camera, background subtraction is far cheaper than dense flow (nothing is written to .flow-vis.pipe):
+#	| bgsubtract --method=mog2 --scale=$FLOW_SCALE \
+
+# to compute full quality flow only around the targets (and a cheap sweep of the rest), feed the tracker back to the flow:
+# mkfifo .roi.pipe, then add --roi-output=.roi.pipe to flow-motiontrack and --roi-input=.roi.pipe to opticalflow
+
+# to run the flow on another machine, have it listen and send the capture there instead:
+#	compute$ opticalflow --input=tcp://:7000 --output=tcp://capture:7001 --scale=$FLOW_SCALE --flow-format=int16
+#	capture$ flow-motiontrack --background-frame=.bg.pipe --flow-frame=tcp://:7001 ...
+#	capture$ videosource "$INPUT_SOURCE" --format=jpeg --output=.bg.pipe:drop,tcp://compute:7000
+
 wait
@@ -0,0 +1,193 @@
+#ifndef avi_HPP
+#define avi_HPP
+
+// STL
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+namespace imgux
+{
+	// writes already JPEG-compressed frames into an MJPG AVI, so encoding doesn't need to happen in cv::VideoWriter
+	// only plain (non-OpenDML) RIFF is written, so files are limited to 2GiB
+	class avi_writer
+	{
+	public:
+		~avi_writer()
+		{
+			close();
+		}
+		
+		bool open(const std::string& file, int width, int height, double fps)
+		{
+			close();
+			out.open(file, std::ios::binary | std::ios::trunc);
+			if(!out)
+				return false;
+			
+			this->width = width;
+			this->height = height;
+			this->fps = fps;
+			frames = 0;
+			max_chunk = 0;
+			index.clear();
+			
+			write_headers();
+			
+			movi_start = out.tellp();
+			fourcc("LIST"); u32(0); fourcc("movi");
+			return true;
+		}
+		
+		bool is_open() const
+		{
+			return out.is_open();
+		}
+		
+		size_t size()
+		{
+			return out.is_open() ? (size_t)out.tellp() : 0;
+		}
+		
+		bool write(const unsigned char* jpeg, size_t len)
+		{
+			if(!out.is_open())
+				return false;
+			
+			if(size() + len + 16 * (index.size() + 1) + 64 > 0x7fffffff)
+			{
+				std::cerr << "avi_writer: error: file is too large for RIFF, dropping frame\n";
+				return false;
+			}
+			
+			index_entry entry;
+			entry.offset = (uint32_t)((size_t)out.tellp() - (movi_start + 8));
+			entry.size = (uint32_t)len;
+			index.push_back(entry);
+			
+			fourcc("00dc"); u32(len);
+			out.write((const char*)jpeg, len);
+			if(len & 1)
+				out.put(0);
+			
+			if(len > max_chunk)
+				max_chunk = len;
+			frames++;
+			
+			return (bool)out;
+		}
+		
+		bool write(const std::vector<unsigned char>& jpeg)
+		{
+			return write(jpeg.data(), jpeg.size());
+		}
+		
+		void close()
+		{
+			if(!out.is_open())
+				return;
+			
+			size_t movi_end = out.tellp();
+			
+			fourcc("idx1"); u32(index.size() * 16);
+			for(const index_entry& entry : index)
+			{
+				fourcc("00dc");
+				u32(0x10); // AVIIF_KEYFRAME, every MJPG frame is one
+				u32(entry.offset);
+				u32(entry.size);
+			}
+			
+			size_t end = out.tellp();
+			
+			// now we know the sizes, patch them in
+			write_headers();
+			out.seekp(4); u32(end - 8);
+			out.seekp(movi_start + 4); u32(movi_end - movi_start - 8);
+			
+			out.close();
+		}
+	
+	private:
+		struct index_entry
+		{
+			uint32_t offset, size;
+		};
+		
+		std::ofstream out;
+		std::vector<index_entry> index;
+		size_t movi_start = 0;
+		size_t frames = 0;
+		size_t max_chunk = 0;
+		int width = 0, height = 0;
+		double fps = 0;
+		
+		void fourcc(const char* cc)
+		{
+			out.write(cc, 4);
+		}
+		void u32(uint32_t v)
+		{
+			out.write((const char*)&v, 4); // AVI is little endian, as are we
+		}
+		void u16(uint16_t v)
+		{
+			out.write((const char*)&v, 2);
+		}
+		
+		// writes (or rewrites) everything up to the movi list; sizes are fixed so this can be done in place
+		void write_headers()
+		{
+			uint32_t rate = (uint32_t)std::round(fps * 1000.0);
+			uint32_t scale = 1000;
+			
+			out.seekp(0);
+			fourcc("RIFF"); u32(0); fourcc("AVI ");
+			
+			fourcc("LIST"); u32(192); fourcc("hdrl");
+			
+			fourcc("avih"); u32(56);
+			u32(fps > 0 ? (uint32_t)std::round(1000000.0 / fps) : 0); // dwMicroSecPerFrame
+			u32(0);                  // dwMaxBytesPerSec
+			u32(0);                  // dwPaddingGranularity
+			u32(0x10);               // dwFlags = AVIF_HASINDEX
+			u32(frames);             // dwTotalFrames
+			u32(0);                  // dwInitialFrames
+			u32(1);                  // dwStreams
+			u32(max_chunk + 8);      // dwSuggestedBufferSize
+			u32(width);
+			u32(height);
+			u32(0); u32(0); u32(0); u32(0);
+			
+			fourcc("LIST"); u32(116); fourcc("strl");
+			
+			fourcc("strh"); u32(56);
+			fourcc("vids"); fourcc("MJPG");
+			u32(0);                  // dwFlags
+			u16(0); u16(0);          // wPriority, wLanguage
+			u32(0);                  // dwInitialFrames
+			u32(scale); u32(rate);
+			u32(0);                  // dwStart
+			u32(frames);             // dwLength
+			u32(max_chunk + 8);      // dwSuggestedBufferSize
+			u32(0xffffffff);         // dwQuality
+			u32(0);                  // dwSampleSize
+			u16(0); u16(0); u16(width); u16(height);
+			
+			fourcc("strf"); u32(40);
+			u32(40);                 // biSize
+			u32(width);
+			u32(height);
+			u16(1);                  // biPlanes
+			u16(24);                 // biBitCount
+			fourcc("MJPG");          // biCompression
+			u32(width * height * 3); // biSizeImage
+			u32(0); u32(0); u32(0); u32(0);
+		}
+	};
+}
+
+#endif
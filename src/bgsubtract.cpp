@@ -0,0 +1,196 @@
+#include <imgux.hpp>
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <vector>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/video/background_segm.hpp>
+
+// a much cheaper stand in for opticalflow on fixed cameras: model the background, and call whatever differs from it motion
+// the output is CV_32FC3 (x velocity, y velocity, foreground) at the working size, which flow-motiontrack reads in place of flow;
+// each blob's velocity is how far its centroid moved since the last frame, in opticalflow's units (15x pixels per frame);
+// flow-scale=1 as the output is already at the size it was measured at, and --scale is noted as motion-scale
+
+struct blob
+{
+	cv::Point2f centroid;
+	cv::Point2f velocity;
+	double radius;
+};
+
+// the simplest model there is: an exponential moving average of the luma, with anything far enough from it foreground
+struct running_average
+{
+	double alpha, threshold;
+	cv::Mat average, diff;
+	
+	running_average(double alpha, double threshold) : alpha(alpha), threshold(threshold)
+	{
+	}
+	
+	void apply(const cv::Mat& gray, cv::Mat& mask)
+	{
+		if(average.empty() or average.size() != gray.size())
+			gray.convertTo(average, CV_32F);
+		
+		cv::Mat current;
+		gray.convertTo(current, CV_32F);
+		cv::absdiff(current, average, diff);
+		cv::threshold(diff, mask, threshold, 255, cv::THRESH_BINARY);
+		mask.convertTo(mask, CV_8U);
+		
+		// don't learn the foreground into the background, else anything that stops is forgotten immediately
+		cv::Mat still = mask == 0;
+		cv::accumulateWeighted(current, average, alpha, still);
+	}
+};
+
+int main(int argc, char** argv)
+{
+	imgux::arguments_add("method", "mog2", "Background model: mog2|mog|average");
+	imgux::arguments_add("scale", "0.5", "Scale the image before modelling it");
+	imgux::arguments_add("history", "200", "Frames of history for mog2");
+	imgux::arguments_add("var-threshold", "16", "Squared Mahalanobis distance for mog2 to call a pixel foreground");
+	imgux::arguments_add("learning-rate", "-1", "How fast the model adapts (0..1), -1 for the model's own default");
+	imgux::arguments_add("average-alpha", "0.05", "Weight of each new frame in the running average");
+	imgux::arguments_add("average-threshold", "25", "Luma difference from the running average to call a pixel foreground");
+	imgux::arguments_add("open", "3", "Size of the morphological opening used to remove speckle from the mask, 0 to disable");
+	imgux::arguments_add("min-area", "0.0005", "Discard blobs smaller than this fraction of the frame");
+	imgux::arguments_parse(argc, argv);
+	
+	std::string method;
+	double scale, var_threshold, learning_rate, average_alpha, average_threshold, min_area;
+	int history, open_size;
+	imgux::arguments_get("method", method);
+	imgux::arguments_get("scale", scale);
+	imgux::arguments_get("history", history);
+	imgux::arguments_get("var-threshold", var_threshold);
+	imgux::arguments_get("learning-rate", learning_rate);
+	imgux::arguments_get("average-alpha", average_alpha);
+	imgux::arguments_get("average-threshold", average_threshold);
+	imgux::arguments_get("open", open_size);
+	imgux::arguments_get("min-area", min_area);
+	
+	std::unique_ptr<cv::BackgroundSubtractorMOG2> mog2;
+	std::unique_ptr<cv::BackgroundSubtractorMOG> mog;
+	std::unique_ptr<running_average> average;
+	
+	if(method == "mog2")
+		mog2.reset(new cv::BackgroundSubtractorMOG2(history, var_threshold, true));
+	else if(method == "mog")
+		mog.reset(new cv::BackgroundSubtractorMOG());
+	else if(method == "average")
+		average.reset(new running_average(average_alpha, average_threshold));
+	else
+	{
+		std::cerr << "bgsubtract: error: --method must be mog2, mog or average\n";
+		return 1;
+	}
+	
+	imgux::frame_setup();
+	
+	cv::Mat frame, scratch, scaled, mask, contour_mask, output;
+	cv::Mat kernel = open_size > 0 ? cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(open_size, open_size)) : cv::Mat();
+	imgux::frame_info info;
+	
+	std::vector<blob> previous, current;
+	std::vector<std::vector<cv::Point>> contours;
+	
+	std::stringstream ss;
+	ss << std::fixed << ";flow-winsize=1;flow-scale=1;motion-scale=" << scale << ";motion-engine=" << method;
+	std::string frameinfo_ext = ss.str();
+	
+	while(true)
+	{
+		if(!imgux::frame_read(frame, info))
+			break;
+		
+		imgux::trace_span span("resize");
+		
+		// mixture models are better in colour, but luma sources are modelled as luma rather than converted
+		bool colour = (frame.channels() == 3 or info.format == imgux::pixel_format::jpeg) and !average;
+		cv::Mat image = colour ? imgux::frame_as_bgr(frame, info, scratch) : imgux::frame_as_gray(frame, info, scratch);
+		cv::Size size = cv::Size(image.cols * scale, image.rows * scale);
+		if(size != image.size())
+		{
+			cv::resize(image, scaled, size, 0, 0, cv::INTER_AREA);
+			image = scaled;
+		}
+		
+		span.next("background model");
+		if(mog2)
+		{
+			(*mog2)(image, mask, learning_rate);
+			cv::threshold(mask, mask, 200, 255, cv::THRESH_BINARY); // shadows are marked 127, they aren't motion
+		}
+		else if(mog)
+			(*mog)(image, mask, learning_rate);
+		else
+			average->apply(image, mask);
+		
+		if(!kernel.empty())
+			cv::morphologyEx(mask, mask, cv::MORPH_OPEN, kernel);
+		
+		span.next("blob scan");
+		
+		// blobs, and their velocity from the nearest blob last frame (if it was close enough to plausibly be the same thing)
+		mask.copyTo(contour_mask); // findContours scribbles on its input
+		cv::findContours(contour_mask, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+		
+		output.create(mask.size(), CV_32FC3);
+		output = cv::Scalar::all(0);
+		current.clear();
+		
+		double area_threshold = min_area * mask.rows * mask.cols;
+		for(size_t i = 0; i < contours.size(); i++)
+		{
+			cv::Moments m = cv::moments(contours[i]);
+			if(m.m00 <= 0 or m.m00 < area_threshold)
+				continue;
+			
+			cv::Rect bounds = cv::boundingRect(contours[i]);
+			blob b;
+			b.centroid = cv::Point2f(m.m10 / m.m00, m.m01 / m.m00);
+			b.radius = std::sqrt(bounds.width * bounds.width + bounds.height * bounds.height) / 2.0;
+			b.velocity = cv::Point2f(0, 0);
+			
+			double best = 0;
+			const blob* match = nullptr;
+			for(const blob& p : previous)
+			{
+				cv::Point2f d = b.centroid - p.centroid;
+				double distance = std::sqrt(d.x * d.x + d.y * d.y);
+				if(distance < std::max(b.radius, p.radius) and (match == nullptr or distance < best))
+				{
+					best = distance;
+					match = &p;
+				}
+			}
+			
+			// a centroid jumps about as the mask's edges change, so smooth it with the blob's last velocity
+			if(match)
+				b.velocity = (b.centroid - match->centroid) * 0.5f + match->velocity * 0.5f;
+			
+			cv::Point2f flow = b.velocity * 15.0f;
+			cv::drawContours(output, contours, i, cv::Scalar(flow.x, flow.y, 1), CV_FILLED);
+			current.push_back(b);
+		}
+		
+		output.setTo(cv::Scalar::all(0), mask == 0); // drawing filled the blobs' holes too
+		std::swap(previous, current);
+		
+		span.end();
+		
+		imgux::frameinfo_remove("repeat", info); // the model moves on even when the frame doesn't, so nothing here is a repeat
+		imgux::frameinfo_remove("damage", info);
+		info.info += frameinfo_ext;
+		info.format = imgux::pixel_format::mat;
+		imgux::frame_write(output, info);
+	}
+	
+	return 0;
+}
@@ -10,16 +10,25 @@
 #include <mutex>
 #include <unordered_map>
 #include <list>
+#include <memory>
+#include <cstdlib>
 
 size_t CONFIRMED_LIFETIME = 10;
 size_t MAX_MISSING_TIME = 30;
 double PROBABILITY_SIZE_GROW = 0.05; // grow the search area by 32px on a 640x640 image in all directions per second missing
 
+// a column of blob pixels, as the scanline fill marks them (it walks down each column in turn)
+struct Run
+{
+	int x, y, length;
+};
+
 struct Island
 {
 	double x, y, w, h, xvel, yvel;
 	bool eaten = false, found_owner = false;
 	double avg_xvel, avg_yvel, eaten_count;
+	std::vector<std::pair<size_t, size_t>> runs; // [begin, end) ranges of this frame's runs that make up the island's mask
 	Island(double x, double y, double w, double h, double xvel, double yvel) : x(x), y(y), w(w), h(h), xvel(xvel), yvel(yvel), avg_xvel(xvel), avg_yvel(yvel), eaten_count(1)
 	{
 	}
@@ -134,34 +143,177 @@ struct Tracked
 	}
 };
 
+// the flow's speed reduced to the fastest pixel in each tile, so the per-pixel work only happens where something moved
+// the reductions are OpenCV's (vectorised) rather than a loop of ours over every pixel
+// bgsubtract sends a third channel marking the foreground, its pixels are given foreground_speed so they always count
+// opticalflow --flow-format=int16 sends planar fixed point; that's never converted to float, the tiles are bounded by
+// max(|x|, |y|) * sqrt(2) (computed in int16), and pixels are tested exactly on their squared length in integers
+struct motion_tiles
+{
+	int tile = 16;
+	int cols = 0, rows = 0;
+	bool fixed = false;
+	float quant = 1; // fixed point units per pixel
+	cv::Size size;
+	std::vector<cv::Mat> planes;
+	cv::Mat speed, abs_x, abs_y, bound, band_max, tiles;
+	
+	void update(const cv::Mat& flow, const imgux::frame_info& info, float foreground_speed)
+	{
+		size = imgux::frame_image_size(flow, info);
+		fixed = imgux::frameinfo_string("flow-layout", info) == "planar";
+		
+		if(fixed)
+		{
+			quant = imgux::frameinfo_number("flow-quant", info);
+			if(quant <= 0)
+				quant = 1;
+			
+			planes.resize(2);
+			planes[0] = flow.rowRange(0, size.height);
+			planes[1] = flow.rowRange(size.height, size.height * 2);
+			cv::absdiff(planes[0], cv::Scalar::all(0), abs_x);
+			cv::absdiff(planes[1], cv::Scalar::all(0), abs_y);
+			cv::max(abs_x, abs_y, bound);
+			reduce(bound, std::sqrt(2.0) / quant);
+			return;
+		}
+		
+		cv::split(flow, planes);
+		if(planes.size() == 3)
+			planes[2].convertTo(speed, CV_32F, foreground_speed);
+		else
+			cv::magnitude(planes[0], planes[1], speed);
+		reduce(speed, 1.0);
+	}
+	
+	// tiles end up as float pixels per frame, whatever type values is
+	void reduce(const cv::Mat& values, double scale)
+	{
+		cols = (values.cols + tile - 1) / tile;
+		rows = (values.rows + tile - 1) / tile;
+		tiles.create(rows, cols, CV_32F);
+		band_max.create(1, cols * tile, values.type());
+		band_max = cv::Scalar(0); // speeds are never negative, so the padding past the edge never wins
+		
+		for(int ty = 0; ty < rows; ty++)
+		{
+			cv::Mat band = values.rowRange(ty * tile, std::min((ty + 1) * tile, values.rows));
+			cv::Mat columns = band_max.colRange(0, values.cols);
+			cv::reduce(band, columns, 0, CV_REDUCE_MAX);
+			
+			cv::Mat row_max, tile_row = tiles.row(ty);
+			cv::reduce(band_max.reshape(1, cols), row_max, 1, CV_REDUCE_MAX);
+			row_max.reshape(1, 1).convertTo(tile_row, CV_32F, scale);
+		}
+	}
+	
+	bool moving(int x, int y, float threshold) const
+	{
+		if(fixed)
+		{
+			int64_t vx = planes[0].at<short>(y, x), vy = planes[1].at<short>(y, x);
+			double t = threshold * quant;
+			return vx * vx + vy * vy > t * t;
+		}
+		return speed.at<float>(y, x) > threshold;
+	}
+	
+	// in the flow's own units: summed over a blob as they are, and divided by units() once for the blob's average
+	cv::Point2f raw_velocity(int x, int y) const
+	{
+		if(fixed)
+			return cv::Point2f(planes[0].at<short>(y, x), planes[1].at<short>(y, x));
+		return cv::Point2f(planes[0].at<float>(y, x), planes[1].at<float>(y, x));
+	}
+	
+	float units() const
+	{
+		return fixed ? quant : 1;
+	}
+	
+	float max(int tx, int ty) const
+	{
+		return tiles.at<float>(ty, tx);
+	}
+	
+	cv::Rect rect(int tx, int ty) const
+	{
+		return cv::Rect(tx * tile, ty * tile, tile, tile) & cv::Rect(0, 0, size.width, size.height);
+	}
+};
+
 int main(int argc, char** argv)
 {
 	imgux::arguments_add("background-frame", "", "The input frame to draw over");
 	imgux::arguments_add("flow-frame", "/dev/stdin", "The input frame to for optical flow");
 	imgux::arguments_add("threshold-big", "10", "Flow velocity to seed a frame.  Independant of frame size");
 	imgux::arguments_add("threshold-small", "5", "Once a seed has been found, how greedy should we be?.  Independant of frame size");
+	imgux::arguments_add("adapt-thresholds", "1", "Raise threshold-small when opticalflow reports it ran at a lower flow-scale");
+	imgux::arguments_add("tile-size", "16", "Find motion on a grid of tiles this big first, then only look at pixels in the tiles that moved");
+	imgux::arguments_add("crops", "", "Also write a crop of each confirmed target, from the full resolution background, here");
+	imgux::arguments_add("crop-width", "0", "Fit crops into this size (letterboxed), 0 to send them at their own size as JPEG");
+	imgux::arguments_add("crop-height", "0", "Fit crops into this size (letterboxed), 0 to send them at their own size as JPEG");
+	imgux::arguments_add("crop-margin", "0.1", "Grow each crop by this fraction of its size on every side");
+	imgux::arguments_add("crop-quality", "90", "JPEG quality (0..100) of crops sent at their own size");
+	imgux::arguments_add("roi-output", "", "Tell opticalflow --roi-input where the targets will be next frame, so it can skip the rest");
+	imgux::arguments_add("roi-margin", "0.25", "Grow each region of interest by this fraction of its target's size on every side");
+	imgux::arguments_add("shape-output", "", "Write each target's mask (run-length encoded) here, a line per flow frame");
+	imgux::arguments_add("shape-contours", "0", "Also write a simplified outline of each target with --shape-output");
+	imgux::arguments_add("contour-epsilon", "1.5", "How far (in flow pixels) the simplified outline may stray from the mask");
 	imgux::arguments_parse(argc, argv);
 	
-	std::string	background_frame, flow_frame;
-	double threshold_big, threshold_small;
+	std::string	background_frame, flow_frame, crops_output, roi_output, shape_output;
+	double threshold_big, threshold_small, crop_margin, roi_margin, contour_epsilon;
+	bool adapt_thresholds, shape_contours;
+	int tile_size, crop_width, crop_height, crop_quality;
 	
 	imgux::arguments_get("background-frame", background_frame);
 	imgux::arguments_get("flow-frame", flow_frame);
 	imgux::arguments_get("threshold-big", threshold_big);
 	imgux::arguments_get("threshold-small", threshold_small);
+	imgux::arguments_get("adapt-thresholds", adapt_thresholds);
+	imgux::arguments_get("tile-size", tile_size);
+	imgux::arguments_get("crops", crops_output);
+	imgux::arguments_get("crop-width", crop_width);
+	imgux::arguments_get("crop-height", crop_height);
+	imgux::arguments_get("crop-margin", crop_margin);
+	imgux::arguments_get("crop-quality", crop_quality);
+	imgux::arguments_get("roi-output", roi_output);
+	imgux::arguments_get("roi-margin", roi_margin);
+	imgux::arguments_get("shape-output", shape_output);
+	imgux::arguments_get("shape-contours", shape_contours);
+	imgux::arguments_get("contour-epsilon", contour_epsilon);
 	
 	assert(background_frame != "");
 	assert(flow_frame != "");
 	
-	std::ifstream bgstream(background_frame);
-	std::ifstream flowstream(flow_frame);
+	imgux::reader bgstream(background_frame);
+	imgux::reader flowstream(flow_frame);
+	
+	// every frame on a stream has to be the same size, so crops are either fitted into one or sent as JPEG
+	std::unique_ptr<imgux::writer> crops;
+	if(crops_output != "")
+		crops.reset(new imgux::writer(crops_output));
+	bool crops_fixed = crop_width > 0 and crop_height > 0;
+	
+	std::unique_ptr<std::ostream> rois;
+	if(roi_output != "")
+		rois.reset(imgux::frame_open_output(roi_output));
 	
-	cv::Mat flow, bg;
+	std::unique_ptr<std::ostream> shapes;
+	if(shape_output != "")
+		shapes.reset(imgux::frame_open_output(shape_output));
+	
+	cv::Mat flow, bg, bg_in, bg_bgr, crop;
+	std::vector<uchar> crop_jpeg;
+	std::vector<int> crop_params = {CV_IMWRITE_JPEG_QUALITY, crop_quality};
 	imgux::frame_info flowinfo, bginfo;
 	
 	imgux::frame_setup();
 	
 	bool running = true;
+	int status = 0;
 	
 	cv::Scalar red(0, 0, 255);
 	cv::Scalar green(0, 255, 0);
@@ -180,8 +332,23 @@ int main(int argc, char** argv)
 	{
 		while(running)
 		{
-			if(!imgux::frame_read(bg, bginfo, bgstream))
+			if(!bgstream.read(bg_in, bginfo))
 				break;
+			imgux::trace_span span("overlay");
+			
+			// draw on (and pass on) the full size level if the source sent a pyramid
+			bg = imgux::frame_as_bgr(imgux::frame_pyramid_level(bg_in, bginfo, 0), bginfo, bg_bgr); // we draw in colour
+			if(bgstream.repeats() and bg.data != bg_bgr.data) // the reader hands the same pixels back for a repeat, keep them clean
+			{
+				bg.copyTo(bg_bgr);
+				bg = bg_bgr;
+			}
+			imgux::frameinfo_remove("repeat", bginfo); // we're about to draw over it, so it's not a repeat anymore
+			imgux::frameinfo_remove("damage", bginfo); // nor are the source's regions all that changed
+			bginfo.format = imgux::pixel_format::mat;
+			imgux::frameinfo_remove("pyramid-levels", bginfo);
+			imgux::frameinfo_remove("pyramid-width", bginfo);
+			imgux::frameinfo_remove("pyramid-height", bginfo);
 			frame_bg = imgux::frameinfo_time(bginfo);
 			
 			double t = frame_bg - frame_motion;
@@ -228,6 +395,48 @@ int main(int argc, char** argv)
 			}
 			*/
 			
+			// cut the crops out before anything is drawn over them
+			if(crops)
+				span.next("crops");
+			for(const Tracked& tg : tracked)
+			{
+				if(!crops or (tg.lifetime - tg.missing_for) < CONFIRMED_LIFETIME)
+					continue;
+				
+				double w = tg.avgw * (1.0 + 2.0 * crop_margin);
+				double h = tg.avgh * (1.0 + 2.0 * crop_margin);
+				double x = tg.x + tg.vx * t - tg.avgw * crop_margin;
+				double y = tg.y + tg.vy * t - tg.avgh * crop_margin;
+				
+				cv::Rect box = cv::Rect(x * bg.cols, y * bg.rows, w * bg.cols, h * bg.rows) & cv::Rect(0, 0, bg.cols, bg.rows);
+				if(box.width <= 0 or box.height <= 0)
+					continue;
+				
+				imgux::frame_info cropinfo = bginfo;
+				cropinfo.info += ";track=" + std::to_string(tg.id) + ";box=" + std::to_string(box.x) + "," + std::to_string(box.y) + "," +
+					std::to_string(box.width) + "," + std::to_string(box.height);
+				
+				if(crops_fixed)
+				{
+					double fit = std::min((double)crop_width / box.width, (double)crop_height / box.height);
+					cv::Size size = cv::Size(std::max(1, (int)(box.width * fit)), std::max(1, (int)(box.height * fit)));
+					
+					crop.create(crop_height, crop_width, CV_8UC3);
+					crop = cv::Scalar::all(0);
+					cv::Mat inner = crop(cv::Rect((crop_width - size.width) / 2, (crop_height - size.height) / 2, size.width, size.height));
+					cv::resize(bg(box), inner, size, 0, 0, fit < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+					crops->write(crop, cropinfo);
+				}
+				else
+				{
+					cv::imencode(".jpg", bg(box), crop_jpeg, crop_params);
+					cropinfo.format = imgux::pixel_format::jpeg;
+					crops->write(cv::Mat(1, (int)crop_jpeg.size(), CV_8UC1, crop_jpeg.data()), cropinfo);
+				}
+			}
+			if(crops)
+				span.next("overlay");
+			
 			auto dotted_line = [](cv::Mat& mat, const cv::Point& from, const cv::Point& to, const cv::Scalar& col, int length = 10, float filled = 0.7)
 			{
 				cv::LineIterator it(mat, from, to, 8);
@@ -290,7 +499,15 @@ int main(int argc, char** argv)
 				}
 			}
 			
+			// let later stages (e.g. recordframes --trigger=tracked) know whether anything is going on
+			size_t confirmed = std::count_if(tracked.begin(), tracked.end(), [](const Tracked& tg)
+			{
+				return (tg.lifetime - tg.missing_for) >= CONFIRMED_LIFETIME;
+			});
+			bginfo.info += ";tracked=" + std::to_string(confirmed) + ";tracking=" + std::to_string(tracked.size());
+			
 			targets_lock.unlock();
+			span.end();
 			imgux::frame_write(bg, bginfo);
 		}
 		running = false;
@@ -299,6 +516,17 @@ int main(int argc, char** argv)
 	cv::Mat blobs;
 	bool first = true;
 	
+	motion_tiles grid;
+	grid.tile = std::max(tile_size, 1);
+	std::vector<int> tile_labels;
+	std::vector<int> tile_stack;
+	std::vector<char> seed_tiles;
+	std::vector<cv::Rect> touched; // tiles we may have marked in blobs, so only they need clearing
+	std::vector<Run> runs, shape_runs; // what the fill marked this frame, if anyone wants the shapes
+	std::vector<int> rle, column_top, column_bottom;
+	std::vector<cv::Point> outline, simplified;
+	bool recording = shapes != nullptr;
+	
 	enum checkfor
 	{
 		nomotion,
@@ -351,16 +579,14 @@ int main(int argc, char** argv)
 	
 	auto is_motion = [&](int x, int y, float threshold)
 	{
-		cv::Point2f vel = flow.at<cv::Point2f>(y, x);
-		float speed = sqrt(vel.x*vel.x + vel.y*vel.y);
-		return speed > threshold;
+		return grid.moving(x, y, threshold);
 	};
 	
 	double lastt = 0, delta = 0, t = 0;
 	
 	while(running)
 	{
-		if(!imgux::frame_read(flow, flowinfo, flowstream))
+		if(!flowstream.read(flow, flowinfo))
 			break;
 		
 		t = imgux::frameinfo_time(flowinfo);
@@ -370,7 +596,17 @@ int main(int argc, char** argv)
 		if(first)
 		{
 			first = false;
-			blobs.create(flow.size(), CV_8UC1);
+			
+			// flow is always a plain mat; anything else is an image stream plugged into the wrong input
+			if(flowinfo.format != imgux::pixel_format::mat)
+			{
+				std::cerr << "flow-motiontrack: error: --flow-frame is a " << imgux::pixel_format_name(flowinfo.format) << " stream, not flow\n";
+				status = 1;
+				break;
+			}
+			
+			blobs.create(imgux::frame_image_size(flow, flowinfo), CV_8UC1);
+			blobs = cv::Scalar(0);
 			
 			winsize = imgux::frameinfo_number("flow-winsize", flowinfo);
 			if(winsize == 0)
@@ -378,16 +614,30 @@ int main(int argc, char** argv)
 				std::cerr << "flow-motiontrack: could not locate flow-winsize, defaulting to 15: " << flowinfo.info << "\n";
 				winsize = 15.0;
 			}
-			winsize_xperc = winsize / (double)flow.size().width;
-			winsize_yperc = winsize / (double)flow.size().height;
 		}
-		blobs = cv::Scalar(0); // reset it
+		
+		// opticalflow --deadline-ms changes these as it goes
+		double flow_winsize = imgux::frameinfo_number("flow-winsize", flowinfo);
+		if(flow_winsize > 0)
+			winsize = flow_winsize;
+		winsize_xperc = winsize / (double)blobs.cols;
+		winsize_yperc = winsize / (double)blobs.rows;
+		
+		double flow_scale = imgux::frameinfo_number("flow-scale", flowinfo);
+		if(flow_scale <= 0)
+			flow_scale = 1.0;
+		
+		for(const cv::Rect& r : touched) // reset it
+			blobs(r) = cv::Scalar(0);
+		touched.clear();
+		runs.clear();
 		
 		// blur it
 		//cv::blur(flow, flow, cv::Size(5, 5));
 		
+		// flow computed at a lower resolution is coarser, so be less greedy when growing blobs (but never stricter than the seed)
 		float big_threshold = threshold_big;
-		float small_threshold = threshold_small;
+		float small_threshold = adapt_thresholds ? std::min(threshold_small / flow_scale, threshold_big) : threshold_small;
 		
 		targets_lock.lock();
 		targets.clear();
@@ -396,7 +646,7 @@ int main(int argc, char** argv)
 		
 		int minx = 0, maxx = 0, miny = 0, maxy = 0;
 		double countvel=0, velx=0, vely = 0;
-		auto testfunc = [&blobs,&maxx,&maxy,&minx,&miny,&countvel,&velx,&vely,small_threshold,&is_motion,&flow,&big_threshold](int xx, int yy, checkfor c)
+		auto testfunc = [&blobs,&maxx,&maxy,&minx,&miny,&countvel,&velx,&vely,small_threshold,&is_motion,&grid,&big_threshold,&runs,recording](int xx, int yy, checkfor c)
 		{
 			bool ret;
 			uchar& b = blobs.at<uchar>(yy, xx);
@@ -417,10 +667,9 @@ int main(int argc, char** argv)
 					if(yy > maxy) maxy = yy;
 					
 					{
-						cv::Point2f& vel = flow.at<cv::Point2f>(yy, xx);
-						float speed = sqrt(vel.x*vel.x + vel.y*vel.y);
+						cv::Point2f vel = grid.raw_velocity(xx, yy);
 						
-						if(speed > big_threshold) // only count velocity from the larger thresholds so noise and stuff doesn't play any roles
+						if(grid.moving(xx, yy, big_threshold)) // only count velocity from the larger thresholds so noise and stuff doesn't play any roles
 						{
 							countvel++;
 							velx += vel.x;
@@ -429,6 +678,15 @@ int main(int argc, char** argv)
 					}
 
 					b = 1;
+					
+					// pixels are marked down a column, so they extend the last run far more often than not
+					if(recording)
+					{
+						if(!runs.empty() and runs.back().x == xx and runs.back().y + runs.back().length == yy)
+							runs.back().length++;
+						else
+							runs.push_back(Run{xx, yy, 1});
+					}
 				}
 			}
 			else if(c == checkfor::scanned)
@@ -437,34 +695,98 @@ int main(int argc, char** argv)
 			return ret;
 		};
 		
-		for(int y = 0; y < flow.rows; y++)
-		for(int x = 0; x < flow.cols; x++)
+		auto grow_blob = [&](int x, int y)
+		{
+			minx = maxx = x;
+			miny = maxy = y;
+			countvel = velx = vely = 0;
+			size_t first_run = runs.size();
+			scanline(x, y, testfunc);
+			
+			// scanline complete, we now have a blob, update the target's vector
+			float xperc = (float)minx / (float)blobs.cols;
+			float yperc = (float)miny / (float)blobs.rows;
+			float sizex = float(maxx - minx) / (float)blobs.cols;
+			float sizey = float(maxy - miny) / (float)blobs.rows;
+			velx = velx / grid.units() / countvel / (float)blobs.rows;
+			vely = vely / grid.units() / countvel / (float)blobs.rows;
+			
+			xperc += winsize_xperc / 2.0;
+			sizex -= winsize_xperc; // don't /2, as when we took xperc away, this shifted half
+			yperc += winsize_yperc / 2.0;
+			sizey -= winsize_yperc;
+			
+			if(sizex > 0.01 and sizey > 0.01)
+			{
+				targets.emplace_back(xperc, yperc, sizex, sizey, velx, vely);
+				if(first_run != runs.size())
+					targets.back().runs.emplace_back(first_run, runs.size());
+			}
+			else
+				runs.resize(first_run);
+		};
+		
+		// label the tiles that moved at all (8-connected), and only bother with groups that contain a seed somewhere;
+		// every pixel above small_threshold lies in such a tile, so growing blobs at full resolution never leaves the group
+		imgux::trace_span span("blob scan");
+		grid.update(flow, flowinfo, std::max(big_threshold, small_threshold) + 1);
+		tile_labels.assign(grid.cols * grid.rows, 0);
+		seed_tiles.assign(grid.cols * grid.rows, 0);
+		int label = 0;
+		
+		for(int ty = 0; ty < grid.rows; ty++)
+		for(int tx = 0; tx < grid.cols; tx++)
 		{
-			if(blobs.at<uchar>(y,x) == 0 and is_motion(x, y, big_threshold))
+			if(tile_labels[ty * grid.cols + tx] != 0 or grid.max(tx, ty) <= big_threshold)
+				continue;
+			
+			label++;
+			tile_stack.assign(1, ty * grid.cols + tx);
+			tile_labels[ty * grid.cols + tx] = label;
+			
+			while(!tile_stack.empty())
 			{
-				minx = maxx = x;
-				miny = maxy = y;
-				countvel = velx = vely = 0;
-				scanline(x, y, testfunc);
+				int index = tile_stack.back();
+				tile_stack.pop_back();
 				
-				// scanline complete, we now have a blob, update the target's vector
-				float xperc = (float)minx / (float)blobs.cols;
-				float yperc = (float)miny / (float)blobs.rows;
-				float sizex = float(maxx - minx) / (float)blobs.cols;
-				float sizey = float(maxy - miny) / (float)blobs.rows;
-				velx = velx / countvel / (float)blobs.rows;
-				vely = vely / countvel / (float)blobs.rows;
+				int cx = index % grid.cols, cy = index / grid.cols;
+				touched.push_back(grid.rect(cx, cy));
+				seed_tiles[index] = grid.max(cx, cy) > big_threshold;
 				
-				xperc += winsize_xperc / 2.0;
-				sizex -= winsize_xperc; // don't /2, as when we took xperc away, this shifted half
-				yperc += winsize_yperc / 2.0;
-				sizey -= winsize_yperc;
+				for(int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, grid.rows - 1); ny++)
+				for(int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, grid.cols - 1); nx++)
+				{
+					int& l = tile_labels[ny * grid.cols + nx];
+					if(l == 0 and grid.max(nx, ny) > small_threshold)
+					{
+						l = label;
+						tile_stack.push_back(ny * grid.cols + nx);
+					}
+				}
+			}
+		}
+		
+		// refine: seed from the pixels of the tiles fast enough to hold one, in the same raster order as a scan of the
+		// whole frame would (the fill's runs and the targets' order depend on where a blob was seeded), just skipping the rest
+		for(int ty = 0; ty < grid.rows; ty++)
+		{
+			cv::Rect band = grid.rect(0, ty);
+			for(int y = band.y; y < band.y + band.height; y++)
+			for(int tx = 0; tx < grid.cols; tx++)
+			{
+				if(!seed_tiles[ty * grid.cols + tx])
+					continue;
 				
-				if(sizex > 0.01 and sizey > 0.01)
-					targets.emplace_back(xperc, yperc, sizex, sizey, velx, vely);
+				cv::Rect r = grid.rect(tx, ty);
+				for(int x = r.x; x < r.x + r.width; x++)
+				{
+					if(blobs.at<uchar>(y,x) == 0 and is_motion(x, y, big_threshold))
+						grow_blob(x, y);
+				}
 			}
 		}
 		
+		span.next("grouping");
 		targets_grouped = targets; // copy them
 		
 		size_t count = targets_grouped.size();
@@ -527,6 +849,7 @@ int main(int argc, char** argv)
 						self.avg_xvel += other.avg_xvel;
 						self.avg_yvel += other.avg_yvel;
 						self.eaten_count += other.eaten_count;
+						self.runs.insert(self.runs.end(), other.runs.begin(), other.runs.end());
 						changing = true;
 					}
 				}
@@ -547,6 +870,7 @@ int main(int argc, char** argv)
 		}
 		
 		// attempt to match to targets
+		span.next("matching");
 		std::unordered_map<Tracked*, std::vector<Island*>> map;
 		static int id = 0;
 		
@@ -602,6 +926,84 @@ int main(int argc, char** argv)
 			<<"\n";
 		};
 		
+		// a target's mask as id:x,y,w,h:counts[:outline], in the flow's pixels; counts alternate between pixels outside and
+		// inside the mask, down each column of the box in turn (column-major, as the fill marks them) starting with outside,
+		// and the outline is x,y pairs split by spaces
+		auto write_shape = [&](std::ostream& out, const char* sep, size_t id, const std::vector<Island*>& islands)
+		{
+			shape_runs.clear();
+			for(const Island* island : islands)
+				for(const auto& range : island->runs)
+					shape_runs.insert(shape_runs.end(), runs.begin() + range.first, runs.begin() + range.second);
+			if(shape_runs.empty())
+				return false;
+			
+			std::sort(shape_runs.begin(), shape_runs.end(), [](const Run& a, const Run& b)
+			{
+				return a.x != b.x ? a.x < b.x : a.y < b.y;
+			});
+			
+			int bx = shape_runs.front().x, bw = shape_runs.back().x - bx + 1;
+			int by = shape_runs.front().y, bottom = by;
+			for(const Run& run : shape_runs)
+			{
+				by = std::min(by, run.y);
+				bottom = std::max(bottom, run.y + run.length);
+			}
+			int bh = bottom - by;
+			
+			rle.clear();
+			int pos = 0;
+			for(const Run& run : shape_runs)
+			{
+				int start = (run.x - bx) * bh + (run.y - by);
+				if(rle.empty() or start > pos)
+				{
+					rle.push_back(start - pos);
+					rle.push_back(run.length);
+				}
+				else // touches the last run (the next column's top, or a second pass down the same column)
+					rle.back() += run.length;
+				pos = start + run.length;
+			}
+			
+			out << sep << id << ":" << bx << "," << by << "," << bw << "," << bh << ":";
+			for(size_t i = 0; i < rle.size(); i++)
+				out << (i ? "," : "") << rle[i];
+			
+			// the outline of each column's extent: along the tops, then back along the bottoms (holes and dents are filled in)
+			if(shape_contours)
+			{
+				column_top.assign(bw, -1);
+				column_bottom.assign(bw, -1);
+				for(const Run& run : shape_runs)
+				{
+					int& top = column_top[run.x - bx];
+					top = top < 0 ? run.y : std::min(top, run.y);
+					column_bottom[run.x - bx] = std::max(column_bottom[run.x - bx], run.y + run.length - 1);
+				}
+				
+				outline.clear();
+				for(int x = 0; x < bw; x++)
+					if(column_top[x] >= 0)
+						outline.push_back(cv::Point(bx + x, column_top[x]));
+				for(int x = bw - 1; x >= 0; x--)
+					if(column_top[x] >= 0)
+						outline.push_back(cv::Point(bx + x, column_bottom[x]));
+				
+				cv::approxPolyDP(outline, simplified, contour_epsilon, true);
+				out << ":";
+				for(size_t i = 0; i < simplified.size(); i++)
+					out << (i ? " " : "") << simplified[i].x << "," << simplified[i].y;
+			}
+			return true;
+		};
+		
+		std::stringstream shape_line;
+		const char* shape_sep = "";
+		if(shapes)
+			shape_line << "time=" << std::fixed << t << ";width=" << blobs.cols << ";height=" << blobs.rows << ";shapes=";
+		
 		std::cerr << "update: " << t << "\n";
 		
 		for(Tracked& t : tracked)
@@ -615,11 +1017,23 @@ int main(int argc, char** argv)
 			{
 				t.missing_for = 0;
 				t.is(it->second, delta);
+				
+				if(shapes)
+				{
+					if(write_shape(shape_line, shape_sep, t.id, it->second))
+						shape_sep = "|";
+				}
 			}
 			
 			write_update(t);
 		}
 		
+		if(shapes)
+		{
+			*shapes << shape_line.str() << "\n";
+			shapes->flush();
+		}
+		
 		tracked.erase(std::remove_if(tracked.begin(), tracked.end(), [](const Tracked& t)
 		{
 			bool ret = t.missing_for > MAX_MISSING_TIME;
@@ -633,7 +1047,34 @@ int main(int argc, char** argv)
 			return ret;
 		}), tracked.end());
 		
+		// where each target is now and where it'll be by the next flow frame, in the flow's pixels (see opticalflow's roi_feed)
+		if(rois)
+		{
+			std::stringstream ss;
+			ss << "time=" << std::fixed << t << ";width=" << blobs.cols << ";height=" << blobs.rows << ";rois=";
+			
+			const char* sep = "";
+			for(const Tracked& tg : tracked)
+			{
+				double w = std::max(tg.w, tg.avgw), h = std::max(tg.h, tg.avgh);
+				double px = tg.x + tg.vx * delta, py = tg.y + tg.vy * delta;
+				double x0 = std::min(tg.x, px) - w * roi_margin, y0 = std::min(tg.y, py) - h * roi_margin;
+				double x1 = std::max(tg.x, px) + w * (1.0 + roi_margin), y1 = std::max(tg.y, py) + h * (1.0 + roi_margin);
+				
+				cv::Rect r = cv::Rect(x0 * blobs.cols, y0 * blobs.rows, (x1 - x0) * blobs.cols + 1, (y1 - y0) * blobs.rows + 1) & cv::Rect(0, 0, blobs.cols, blobs.rows);
+				if(r.width <= 0 or r.height <= 0)
+					continue;
+				
+				ss << sep << r.x << "," << r.y << "," << r.width << "," << r.height;
+				sep = "|";
+			}
+			
+			*rois << ss.str() << "\n";
+			rois->flush();
+		}
+		
 		targets_lock.unlock();
+		span.end();
 		
 		// scanline
 		//u.at<Point2f>(y, x);
@@ -643,7 +1084,13 @@ int main(int argc, char** argv)
 	}
 	
 	running = false;
+	
+	// the background reader stops at its next frame, but on an error that may never come (its source can be waiting on
+	// the flow we stopped reading), and it still uses the default writer, so leave without joining it or running atexit
+	if(status != 0)
+		std::_Exit(status);
+	
 	t_bg.join();
 	
-	return 0;
+	return status;
 }
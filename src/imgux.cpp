@@ -5,8 +5,33 @@
 #include <sstream>
 #include <fstream>
 #include <regex>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
 // STD
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+// POSIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// OpenCV
+#include <opencv2/highgui/highgui.hpp>
 
 using namespace imgux;
 
@@ -91,10 +116,79 @@ std::vector<std::string> imgux::arguments_get_list()
 	return arguments_list;
 }
 
+// tracing
+std::mutex trace_lock;
+std::ofstream* trace_out = nullptr;
+std::atomic<bool> tracing(false);
+std::atomic<int> trace_threads(0);
+thread_local size_t trace_current_frame = 0;
+
+void trace_stop()
+{
+	std::lock_guard<std::mutex> lk(trace_lock);
+	tracing = false;
+	if(!trace_out)
+		return;
+	*trace_out << "\n]\n";
+	delete trace_out;
+	trace_out = nullptr;
+}
+
+void trace_start(const std::string& file, const std::string& program)
+{
+	trace_out = new std::ofstream(file);
+	if(!*trace_out)
+	{
+		std::cerr << "imgux: can't open trace file " << file << "\n";
+		delete trace_out;
+		trace_out = nullptr;
+		return;
+	}
+	
+	*trace_out << "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << getpid() << ",\"args\":{\"name\":\"" << program << "\"}}";
+	tracing = true;
+	std::atexit(trace_stop);
+}
+
+bool imgux::trace_enabled()
+{
+	return tracing.load(std::memory_order_relaxed);
+}
+
+int64_t imgux::trace_now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void imgux::trace_frame(size_t frame)
+{
+	trace_current_frame = frame;
+}
+
+void imgux::trace_record(const char* name, int64_t start)
+{
+	int64_t end = imgux::trace_now();
+	static thread_local int tid = ++trace_threads;
+	
+	char event[256];
+	int len = snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"imgux\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%zu}}",
+		name, (long long)start, (long long)(end - start), (int)getpid(), tid, trace_current_frame);
+	
+	std::lock_guard<std::mutex> lk(trace_lock);
+	if(trace_out and len > 0)
+		trace_out->write(event, std::min<int>(len, sizeof(event) - 1));
+}
+
 void imgux::arguments_parse(int argc, char** argv)
 {
-	imgux::arguments_add("input", "/dev/stdin", "Input file");
-	imgux::arguments_add("output", "/dev/stdout", "Output file");
+	imgux::arguments_add("input", "/dev/stdin", "Input file, or tcp://[host]:port or unix:/path to wait for one sender on (the stream ends when it disconnects)");
+	imgux::arguments_add("output", "/dev/stdout", "Output file, tcp://host:port or unix:/path, or a comma separated list of them (path[:block|:drop|:latest]); a socket only reconnects if it has a policy");
+	imgux::arguments_add("output-queue", "4", "How many frames each output may fall behind by when there are several");
+	imgux::arguments_add("io", "fd", "How to read and write frames: fd (raw file descriptors) or stream (iostreams)");
+	imgux::arguments_add("pipe-size", "1048576", "Grow pipes and FIFOs we read or write to this many bytes, 0 to leave them alone");
+	imgux::arguments_add("trace", "", "Write Chrome trace events (chrome://tracing, Perfetto) for this process to this file");
+	imgux::arguments_add("elide-repeats", "0", "Send frames that haven't changed since the last one as a tiny repeat record instead of the pixels");
+	imgux::arguments_add("repeat-tolerance", "0", "With --elide-repeats, call a frame a repeat if no byte differs by more than this (0 for identical)");
 	
 	bool readargs = true;
 	for(int n = 0; n < argc; n++)
@@ -137,22 +231,725 @@ void imgux::arguments_parse(int argc, char** argv)
 		else
 			arguments_list.push_back(v);
 	}
+	
+	std::string trace;
+	imgux::arguments_get("trace", trace);
+	if(trace != "")
+	{
+		std::string program = argc > 0 ? argv[0] : "imgux";
+		trace_start(trace, program.substr(program.rfind('/') + 1));
+	}
 }
 
 std::istream* stream_in = nullptr;
 std::ostream* stream_out = nullptr;
+imgux::reader* default_reader = nullptr;
+imgux::writer* default_writer = nullptr;
 bool setup = false;
 
-struct state_info
+// raw file descriptor I/O: frames are big and few, so we want as few syscalls and copies per frame as possible
+// reads of a payload go straight into the cv::Mat (readv also refills our buffer with the start of the next record),
+// and a payload write goes out with the header/info before it in one writev, without being copied into a buffer first
+const size_t fd_buffer_size = 64 * 1024;
+const size_t fd_direct_size = 4 * 1024; // reads/writes at least this big bypass the buffer
+
+struct aligned_buffer
+{
+	char* data = nullptr;
+	aligned_buffer(size_t size)
+	{
+		if(posix_memalign((void**)&data, 4096, size) != 0)
+			data = nullptr;
+	}
+	~aligned_buffer()
+	{
+		free(data);
+	}
+};
+
+void fd_grow_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	int size = 0;
+	imgux::arguments_get("pipe-size", size);
+	
+	struct stat st;
+	if(size > 0 and fstat(fd, &st) == 0 and S_ISFIFO(st.st_mode))
+		fcntl(fd, F_SETPIPE_SZ, size); // unprivileged users are capped by /proc/sys/fs/pipe-max-size, then we keep what we had
+#else
+	(void)fd;
+#endif
+}
+
+class fd_istreambuf : public std::streambuf
+{
+public:
+	fd_istreambuf(int fd) : fd(fd), buffer(fd_buffer_size)
+	{
+		setg(buffer.data, buffer.data, buffer.data);
+	}
+	~fd_istreambuf()
+	{
+		if(fd > STDERR_FILENO)
+			::close(fd);
+	}
+protected:
+	int fd;
+	aligned_buffer buffer;
+	
+	int_type underflow() override
+	{
+		if(gptr() < egptr())
+			return traits_type::to_int_type(*gptr());
+		
+		ssize_t got;
+		do
+			got = ::read(fd, buffer.data, fd_buffer_size);
+		while(got < 0 and errno == EINTR);
+		
+		if(got <= 0)
+			return traits_type::eof();
+		
+		setg(buffer.data, buffer.data, buffer.data + got);
+		return traits_type::to_int_type(*gptr());
+	}
+	
+	std::streamsize xsgetn(char* s, std::streamsize n) override
+	{
+		std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+		memcpy(s, gptr(), done);
+		gbump(done);
+		
+		if(n - done < (std::streamsize)fd_direct_size)
+			return done + std::streambuf::xsgetn(s + done, n - done);
+		
+		while(done < n)
+		{
+			struct iovec iov[2];
+			iov[0].iov_base = s + done;
+			iov[0].iov_len = n - done;
+			iov[1].iov_base = buffer.data;
+			iov[1].iov_len = fd_buffer_size;
+			
+			ssize_t got = ::readv(fd, iov, 2);
+			if(got < 0 and errno == EINTR)
+				continue;
+			if(got <= 0)
+				break;
+			
+			if(got > n - done)
+			{
+				setg(buffer.data, buffer.data, buffer.data + (got - (n - done)));
+				done = n;
+			}
+			else
+				done += got;
+		}
+		return done;
+	}
+};
+
+class fd_ostreambuf : public std::streambuf
+{
+public:
+	fd_ostreambuf(int fd) : fd(fd), buffer(fd_buffer_size)
+	{
+		setp(buffer.data, buffer.data + fd_buffer_size);
+		
+		struct stat st;
+		is_socket = fstat(fd, &st) == 0 and S_ISSOCK(st.st_mode);
+	}
+	~fd_ostreambuf()
+	{
+		sync();
+		if(fd > STDERR_FILENO)
+			::close(fd);
+	}
+protected:
+	int fd;
+	aligned_buffer buffer;
+	bool failed = false;
+	bool is_socket = false;
+	
+	// writes what's buffered, then extra (if any), in as few syscalls as the kernel will let us
+	bool write_out(const char* extra, size_t extra_len)
+	{
+		struct iovec iov[2];
+		iov[0].iov_base = pbase();
+		iov[0].iov_len = pptr() - pbase();
+		iov[1].iov_base = (void*)extra;
+		iov[1].iov_len = extra_len;
+		
+		int first = 0;
+		while(!failed and first < 2)
+		{
+			if(iov[first].iov_len == 0)
+			{
+				first++;
+				continue;
+			}
+			
+			ssize_t wrote;
+			if(is_socket) // a receiver going away should fail the write (so we can reconnect), not SIGPIPE us
+			{
+				struct msghdr msg = {};
+				msg.msg_iov = iov + first;
+				msg.msg_iovlen = 2 - first;
+				wrote = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+			}
+			else
+				wrote = ::writev(fd, iov + first, 2 - first);
+			if(wrote < 0 and errno == EINTR)
+				continue;
+			if(wrote < 0)
+			{
+				failed = true;
+				break;
+			}
+			
+			for(int i = first; i < 2 and wrote > 0; i++)
+			{
+				size_t used = std::min<size_t>(wrote, iov[i].iov_len);
+				iov[i].iov_base = (char*)iov[i].iov_base + used;
+				iov[i].iov_len -= used;
+				wrote -= used;
+			}
+		}
+		
+		setp(buffer.data, buffer.data + fd_buffer_size);
+		return !failed;
+	}
+	
+	int_type overflow(int_type ch) override
+	{
+		if(!write_out(nullptr, 0))
+			return traits_type::eof();
+		if(ch != traits_type::eof())
+		{
+			*pptr() = (char)ch;
+			pbump(1);
+		}
+		return ch;
+	}
+	
+	std::streamsize xsputn(const char* s, std::streamsize n) override
+	{
+		if(n < (std::streamsize)fd_direct_size)
+			return std::streambuf::xsputn(s, n);
+		return write_out(s, n) ? n : 0;
+	}
+	
+	int sync() override
+	{
+		return write_out(nullptr, 0) ? 0 : -1;
+	}
+};
+
+class fd_istream : public std::istream
+{
+public:
+	fd_istreambuf buf;
+	fd_istream(int fd) : std::istream(nullptr), buf(fd)
+	{
+		rdbuf(&buf);
+	}
+};
+
+class fd_ostream : public std::ostream
 {
+public:
+	fd_ostreambuf buf;
+	fd_ostream(int fd) : std::ostream(nullptr), buf(fd)
+	{
+		rdbuf(&buf);
+	}
+};
+
+// sockets: an input listens on tcp://[host]:port or unix:/path and takes the first sender to connect,
+// an output connects to one (waiting for it to come up, like opening a FIFO waits for a reader)
+bool socket_address(const std::string& path, std::string& host, std::string& port, bool& unix_socket)
+{
+	if(path.compare(0, 5, "unix:") == 0)
+	{
+		unix_socket = true;
+		host = path.substr(5);
+		return true;
+	}
+	if(path.compare(0, 6, "tcp://") == 0)
+	{
+		unix_socket = false;
+		size_t colon = path.rfind(':');
+		if(colon < 6)
+			return false;
+		host = path.substr(6, colon - 6);
+		port = path.substr(colon + 1);
+		return true;
+	}
+	return false;
+}
+
+bool is_socket_path(const std::string& path)
+{
+	std::string host, port;
+	bool unix_socket;
+	return socket_address(path, host, port, unix_socket);
+}
+
+// -1 if the address is bad; connect failures are retried until give_up() says otherwise
+int socket_open(const std::string& path, bool listening, const std::function<bool()>& give_up)
+{
+	std::string host, port;
+	bool unix_socket;
+	if(!socket_address(path, host, port, unix_socket))
+		return -1;
+	
+	// a host can resolve to several addresses (localhost to ::1 and 127.0.0.1, say), and any of them might be the one that works
+	struct sockaddr_un un = {};
+	struct addrinfo local = {};
+	struct addrinfo* addresses = nullptr;
+	const struct addrinfo* candidates;
+	
+	if(unix_socket)
+	{
+		if(host.size() >= sizeof(un.sun_path))
+		{
+			std::cerr << "imgux: error: socket path too long: " << host << "\n";
+			return -1;
+		}
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, host.c_str(), sizeof(un.sun_path) - 1);
+		local.ai_family = AF_UNIX;
+		local.ai_addr = (struct sockaddr*)&un;
+		local.ai_addrlen = sizeof(un);
+		candidates = &local;
+	}
+	else
+	{
+		struct addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+		
+		int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses);
+		if(err != 0)
+		{
+			std::cerr << "imgux: error: can't resolve " << path << ": " << gai_strerror(err) << "\n";
+			return -1;
+		}
+		candidates = addresses;
+	}
+	
+	int fd = -1;
+	if(listening)
+	{
+		if(unix_socket)
+			::unlink(host.c_str()); // left over from a previous run
+		
+		int server = -1;
+		for(const struct addrinfo* a = candidates; a and server < 0; a = a->ai_next)
+		{
+			server = ::socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			int yes = 1;
+			if(server >= 0)
+				setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			
+			if(server >= 0 and (::bind(server, a->ai_addr, a->ai_addrlen) != 0 or ::listen(server, 1) != 0))
+			{
+				int bind_errno = errno;
+				::close(server);
+				server = -1;
+				errno = bind_errno;
+			}
+		}
+		
+		if(server < 0)
+			std::cerr << "imgux: error: can't listen on " << path << ": " << strerror(errno) << "\n";
+		else
+		{
+			std::cerr << "imgux: waiting for a sender on " << path << "\n";
+			do
+				fd = ::accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+			while(fd < 0 and errno == EINTR);
+			::close(server); // one sender per input: when it's done, so is the stream
+		}
+		
+		if(unix_socket)
+			::unlink(host.c_str());
+	}
+	else
+	{
+		bool waiting = false;
+		while(true)
+		{
+			for(const struct addrinfo* a = candidates; a and fd < 0; a = a->ai_next)
+			{
+				fd = ::socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				if(fd >= 0 and ::connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+				{
+					::close(fd);
+					fd = -1;
+				}
+			}
+			
+			if(fd >= 0 or give_up())
+				break;
+			if(!waiting)
+				std::cerr << "imgux: waiting for " << path << " to accept connections\n";
+			waiting = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		}
+	}
+	
+	if(addresses)
+		freeaddrinfo(addresses);
+	
+	if(fd >= 0 and !unix_socket)
+	{
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // records are already written whole, see fanout_sink
+	}
+	return fd;
+}
+
+bool use_fd_io()
+{
+	std::string io = "fd";
+	imgux::arguments_get("io", io);
+	return io != "stream";
+}
+
+std::istream* open_input_stream(const std::string& path)
+{
+	if(is_socket_path(path))
+	{
+		int fd = socket_open(path, true, [] { return true; });
+		return fd < 0 ? new std::ifstream() : (std::istream*)new fd_istream(fd); // an unopened ifstream fails its first read
+	}
+	
+	if(!use_fd_io())
+		return new std::ifstream(path);
+	
+	int fd = path == "/dev/stdin" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return new std::ifstream(path); // fails the same way it always has
+	
+	fd_grow_pipe(fd);
+	return new fd_istream(fd);
+}
+
+std::ostream* open_output_stream(const std::string& path)
+{
+	if(is_socket_path(path)) // waits for the receiver like opening a FIFO does, but there's no reconnecting without a sink
+	{
+		int fd = socket_open(path, false, [] { return false; });
+		std::ostream* out = fd < 0 ? new std::ofstream() : (std::ostream*)new fd_ostream(fd);
+		if(fd < 0)
+			out->setstate(std::ios::badbit);
+		return out;
+	}
+	
+	if(!use_fd_io())
+		return new std::ofstream(path);
+	
+	int fd = path == "/dev/stdout" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd < 0)
+		return new std::ofstream(path);
+	
+	fd_grow_pipe(fd);
+	return new fd_ostream(fd);
+}
+
+// fan-out: one serialized frame shared between many sinks, each with its own writer thread
+typedef std::shared_ptr<const std::string> record_ptr;
+
+struct fanout_sink
+{
+	enum policy_t
+	{
+		block,
+		drop,
+		latest
+	};
+	
+	std::string path;
+	policy_t policy = block;
+	size_t max_queue = 4;
+	size_t dropped = 0;
+	
+	std::deque<record_ptr> queue;
+	std::mutex lock;
+	std::condition_variable changed;
+	bool closing = false;
+	std::string header; // split off the first record, and written at the start of every stream the worker opens
 	bool first = true;
-	int width = 0;
-	int height = 0;
-	size_t elm_size = 0;
-	size_t type = 0;
-	size_t data_size = 0;
+	record_ptr last_full; // the newest record with pixels in it, and whether we dropped it (see push)
+	bool lost = false;
+	std::thread worker;
+	
+	void start()
+	{
+		worker = std::thread([this]
+		{
+			bool socket = is_socket_path(this->path);
+			std::unique_ptr<std::ostream> out(this->open()); // opened here, as a FIFO with no reader yet would block everyone
+			std::vector<record_ptr> batch;
+			std::string header;
+			record_ptr sent_full; // the last record with pixels in it we wrote, for a new receiver to start from
+			bool fresh = true; // nothing written on out yet, so it needs the header first
+			
+			while(true)
+			{
+				// small records (flow at a low scale, say) are sent several to a write when we've fallen behind
+				batch.clear();
+				{
+					std::unique_lock<std::mutex> lk(this->lock);
+					this->changed.wait(lk, [this] { return this->closing or !this->queue.empty(); });
+					
+					size_t bytes = 0;
+					while(!this->queue.empty() and (batch.empty() or bytes + this->queue.front()->size() <= fd_buffer_size))
+					{
+						bytes += this->queue.front()->size();
+						batch.push_back(this->queue.front());
+						this->queue.pop_front();
+					}
+					
+					if(batch.empty())
+						break;
+					
+					if(header.empty())
+						header = this->header;
+				}
+				this->changed.notify_all();
+				
+				if(fresh)
+					out->write(header.data(), header.size());
+				fresh = false;
+				for(const record_ptr& rec : batch)
+					out->write(rec->data(), rec->size());
+				out->flush();
+				
+				// the receiver went away: wait for it (or another) to come back, and start it a fresh stream with this batch
+				while(socket and !*out and !this->is_closing())
+				{
+					std::cerr << "imgux: lost " << this->path << ", reconnecting\n";
+					out.reset(this->open());
+					if(!*out)
+					{
+						socket = false; // a bad address or we're closing, either way there's no one to send to
+						break;
+					}
+					
+					out->write(header.data(), header.size());
+					if(sent_full and is_repeat(*batch.front())) // it has nothing to repeat yet
+						out->write(sent_full->data(), sent_full->size());
+					for(const record_ptr& rec : batch)
+						out->write(rec->data(), rec->size());
+					out->flush();
+				}
+				
+				for(const record_ptr& rec : batch)
+					if(!is_repeat(*rec))
+						sent_full = rec;
+			}
+			
+			if(this->dropped > 0)
+				std::cerr << "imgux: dropped " << this->dropped << " frames for slow output " << this->path << "\n";
+		});
+	}
+	
+	bool is_closing()
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		return closing;
+	}
+	
+	std::ostream* open()
+	{
+		if(!is_socket_path(path))
+			return open_output_stream(path);
+		
+		int fd = socket_open(path, false, [this] { return this->is_closing(); });
+		if(fd < 0)
+		{
+			std::ostream* out = new std::ofstream(); // fails every write, so we'll try again
+			out->setstate(std::ios::badbit);
+			return out;
+		}
+		return new fd_ostream(fd);
+	}
+	
+	// the "opencv-mat..." line and the sizes after it: the start of the first record, and what a receiver needs first
+	// text outputs (flow-motiontrack's rois, say) have no header, every line of theirs is a record
+	static std::string stream_header(const std::string& first)
+	{
+		size_t eol = first.find('\n');
+		if(eol == std::string::npos or first.compare(0, 10, "opencv-mat") != 0)
+			return std::string();
+		return first.substr(0, eol + 1 + 2 * sizeof(int) + 2 * sizeof(size_t));
+	}
+	
+	// a repeat record (see writer::repeated) is its info line ending in ;repeat=1 and nothing else
+	static bool is_repeat(const std::string& rec)
+	{
+		static const std::string marker = ";repeat=1";
+		size_t eol = rec.find('\n');
+		return eol != std::string::npos and eol >= marker.size() and rec.compare(eol - marker.size(), marker.size(), marker) == 0;
+	}
+	
+	void push(const record_ptr& rec)
+	{
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			
+			// the header is kept out of the queue, so any record in it can be dropped without the stream losing its start
+			record_ptr body = rec;
+			if(first)
+			{
+				first = false;
+				header = stream_header(*rec);
+				body = std::make_shared<const std::string>(rec->substr(header.size()));
+			}
+			
+			bool repeat = is_repeat(*body);
+			if(!repeat)
+				last_full = body;
+			
+			if(queue.size() >= max_queue)
+			{
+				if(policy == drop)
+				{
+					dropped++;
+					lost = lost or !repeat;
+					return;
+				}
+				else if(policy == latest)
+				{
+					dropped++;
+					lost = lost or queue.front() == last_full;
+					queue.pop_front();
+				}
+				else
+					changed.wait(lk, [this] { return this->queue.size() < this->max_queue; });
+			}
+			
+			// a repeat of a frame this sink never got is no use to it, so send it the frame (with its older info) instead
+			queue.push_back(repeat and lost ? last_full : body);
+			lost = false;
+		}
+		changed.notify_all();
+	}
+	
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			closing = true;
+		}
+		changed.notify_all();
+		worker.join();
+	}
+};
+
+// collects everything written between flushes (frame_write flushes after every frame) into one record
+class fanout_streambuf : public std::streambuf
+{
+public:
+	std::vector<std::unique_ptr<fanout_sink>> sinks;
+	std::string pending;
+	
+	~fanout_streambuf()
+	{
+		sync();
+		for(auto& sink : sinks)
+			sink->close();
+	}
+protected:
+	int_type overflow(int_type ch) override
+	{
+		if(ch != traits_type::eof())
+			pending.push_back((char)ch);
+		return ch;
+	}
+	std::streamsize xsputn(const char* s, std::streamsize n) override
+	{
+		pending.append(s, n);
+		return n;
+	}
+	int sync() override
+	{
+		if(pending.empty())
+			return 0;
+		
+		size_t size = pending.size();
+		record_ptr rec = std::make_shared<const std::string>(std::move(pending));
+		pending = std::string();
+		pending.reserve(size);
+		
+		for(auto& sink : sinks)
+			sink->push(rec);
+		return 0;
+	}
 };
 
+class fanout_ostream : public std::ostream
+{
+public:
+	fanout_streambuf buf;
+	fanout_ostream() : std::ostream(nullptr)
+	{
+		rdbuf(&buf);
+	}
+};
+
+std::istream* imgux::frame_open_input(const std::string& spec)
+{
+	return open_input_stream(spec);
+}
+
+std::ostream* imgux::frame_open_output(const std::string& spec)
+{
+	std::vector<std::string> paths;
+	std::stringstream ss(spec);
+	std::string path;
+	while(std::getline(ss, path, ','))
+		if(path != "")
+			paths.push_back(path);
+	
+	auto policy_of = [](const std::string& path)
+	{
+		size_t colon = path.rfind(':');
+		std::string policy = colon == std::string::npos ? "" : path.substr(colon + 1);
+		return policy == "block" or policy == "drop" or policy == "latest" ? policy : std::string();
+	};
+	
+	// sharing a frame between sinks means copying it into a record first, only worth it for several outputs or a queue
+	if(paths.size() == 1 and policy_of(paths[0]) == "")
+		return open_output_stream(paths[0]);
+	
+	int max_queue = 4;
+	imgux::arguments_get("output-queue", max_queue);
+	
+	fanout_ostream* out = new fanout_ostream();
+	for(std::string& path : paths)
+	{
+		fanout_sink* sink = new fanout_sink();
+		
+		std::string policy = policy_of(path);
+		if(policy != "")
+		{
+			path = path.substr(0, path.rfind(':'));
+			sink->policy = policy == "drop" ? fanout_sink::drop : policy == "latest" ? fanout_sink::latest : fanout_sink::block;
+		}
+		
+		sink->path = path;
+		sink->max_queue = std::max(max_queue, 1);
+		sink->start();
+		out->buf.sinks.emplace_back(sink);
+	}
+	
+	return out;
+}
+
 void imgux::frame_setup()
 {
 	std::string input, output;
@@ -161,13 +958,25 @@ void imgux::frame_setup()
 	imgux::arguments_get("input", input);
 	imgux::arguments_get("output", output);
 	
-	stream_in = new std::ifstream(input);
-	stream_out = new std::ofstream(output);
+	stream_in = imgux::frame_open_input(input);
+	stream_out = imgux::frame_open_output(output);
+	default_reader = new imgux::reader(*stream_in);
+	default_writer = new imgux::writer(*stream_out);
 	setup = true;
+	
+	// make sure queued frames make it out when main returns
+	std::atexit([]
+	{
+		imgux::frame_close();
+	});
 }
 
 void imgux::frame_close()
 {
+	delete default_reader;
+	delete default_writer;
+	default_reader = nullptr;
+	default_writer = nullptr;
 	delete stream_in;
 	delete stream_out;
 	stream_in = nullptr;
@@ -184,6 +993,16 @@ std::ostream* imgux::frame_default_output()
 	return stream_out;
 }
 
+imgux::reader* imgux::frame_default_reader()
+{
+	return default_reader;
+}
+
+imgux::writer* imgux::frame_default_writer()
+{
+	return default_writer;
+}
+
 double imgux::frameinfo_time(const imgux::frame_info& info)
 {
 	static std::regex time_regex("time=([0-9\\.]+)");
@@ -244,7 +1063,7 @@ double imgux::frameinfo_number(std::string name, const imgux::frame_info& info)
 {
 	escape_regex(name);
 	
-	static std::unordered_map<std::string, std::regex> regexes; // im not sure re-compiling so often is a good idea...
+	static thread_local std::unordered_map<std::string, std::regex> regexes; // im not sure re-compiling so often is a good idea...
 	auto kv = regexes.find(name);
 	
 	if(kv == regexes.end())
@@ -268,12 +1087,12 @@ std::string imgux::frameinfo_string(std::string name, const imgux::frame_info& i
 {
 	escape_regex(name);
 	
-	static std::unordered_map<std::string, std::regex> regexes; // im not sure re-compiling so often is a good idea...
+	static thread_local std::unordered_map<std::string, std::regex> regexes; // im not sure re-compiling so often is a good idea...
 	auto kv = regexes.find(name);
 	
 	if(kv == regexes.end())
 	{
-		regexes[name] = std::regex(name + "=(.+?);?");
+		regexes[name] = std::regex(name + "=([^;]*)");
 		kv = regexes.find(name);
 		assert(kv != regexes.end());
 	}
@@ -289,68 +1108,469 @@ std::string imgux::frameinfo_string(std::string name, const imgux::frame_info& i
 	return "";
 }
 
+bool imgux::frameinfo_has(std::string name, const imgux::frame_info& info)
+{
+	name += "=";
+	size_t pos = info.info.find(name);
+	
+	while(pos != std::string::npos)
+	{
+		if(pos == 0 or info.info[pos - 1] == ';')
+			return true;
+		pos = info.info.find(name, pos + 1);
+	}
+	
+	return false;
+}
+
+void imgux::frameinfo_remove(std::string name, imgux::frame_info& info)
+{
+	name += "=";
+	size_t pos = info.info.find(name);
+	
+	while(pos != std::string::npos)
+	{
+		if(pos == 0 or info.info[pos - 1] == ';')
+		{
+			size_t end = info.info.find(';', pos);
+			if(end == std::string::npos)
+				info.info.erase(pos == 0 ? 0 : pos - 1); // the last one, take its leading ; with it
+			else
+				info.info.erase(pos, end - pos + 1);
+			pos = info.info.find(name, pos == 0 ? 0 : pos - 1);
+		}
+		else
+			pos = info.info.find(name, pos + 1);
+	}
+}
+
+std::vector<cv::Rect> imgux::frameinfo_rects(std::string name, const imgux::frame_info& info)
+{
+	std::vector<cv::Rect> ret;
+	std::stringstream ss(imgux::frameinfo_string(name, info));
+	std::string item;
+	
+	while(std::getline(ss, item, '|'))
+	{
+		cv::Rect r;
+		char sep;
+		std::stringstream rs(item);
+		
+		if(rs >> r.x >> sep >> r.y >> sep >> r.width >> sep >> r.height)
+			ret.push_back(r);
+	}
+	
+	return ret;
+}
+
 // OpenCV frame read/writers
-bool imgux::frame_read(cv::Mat& output, frame_info& info, std::istream& sin)
+imgux::reader::reader(std::istream& in) : in(&in)
+{
+}
+
+imgux::reader::reader(const std::string& spec) : owned(imgux::frame_open_input(spec)), in(owned.get())
+{
+}
+
+std::istream& imgux::reader::stream()
 {
+	return *in;
+}
+
+bool imgux::reader::read(cv::Mat& output, frame_info& info)
+{
+	imgux::trace_span span("frame_read");
+	std::istream& sin = *in;
 	if(sin.eof())
 		return false;
 	
-	static std::unordered_map<const cv::Mat*, state_info> states;
-	state_info& state = states[&output];
-	
-	if(state.first)
+	if(!started)
 	{
-		state.first = false;
+		started = true;
 		
-		char fmt_buff[128];
-		sin.getline(fmt_buff, 128);
-		std::string fmt = fmt_buff;
+		std::string fmt;
+		if(!std::getline(sin, fmt)) // nothing was sent, or the input never opened
+			return false;
 		
-		assert(fmt == "opencv-mat");
+		// "opencv-mat" optionally followed by the pixel format, and "repeats" if the writer elides them
+		assert(fmt.compare(0, 10, "opencv-mat") == 0);
+		std::stringstream tokens(fmt.substr(10));
+		std::string token;
+		while(tokens >> token)
+		{
+			if(token == "repeats")
+				may_repeat = true;
+			else if(!imgux::pixel_format_parse(token, format))
+			{
+				std::cerr << "imgux: unknown pixel format " << token << "\n";
+				return false;
+			}
+		}
 		
-		sin.read((char*)&state.width,    sizeof(state.width));
-		sin.read((char*)&state.height,   sizeof(state.height));
-		sin.read((char*)&state.elm_size, sizeof(state.elm_size));
-		sin.read((char*)&state.type,     sizeof(state.type));
+		sin.read((char*)&width,    sizeof(width));
+		sin.read((char*)&height,   sizeof(height));
+		sin.read((char*)&elm_size, sizeof(elm_size));
+		sin.read((char*)&type,     sizeof(type));
 		
-		state.data_size = state.width * state.height * state.elm_size;
+		data_size = width * height * elm_size;
 	}
 	
-	if(output.cols != state.width or output.rows != state.height or output.elemSize() != state.elm_size or output.type() != state.type)
-		output.create(state.width, state.height, state.type);
+	if(output.cols != width or output.rows != height or output.elemSize() != elm_size or output.type() != type)
+		output.create(width, height, type);
+	
+	std::getline(sin, info.info);
 	
-	static char buff[128];
-	sin.getline(buff, 128);
+	// we joined a stream part way through (a sender reconnecting, say), and a repeat of a frame we never got is no use
+	while(may_repeat and last.empty() and imgux::frame_repeated(info))
+		if(!std::getline(sin, info.info))
+			return false;
 	
-	info.info = buff;
-	sin.read((char*)output.ptr(), state.data_size);
+	info.format = format;
+	if(imgux::trace_enabled())
+		imgux::trace_frame(imgux::frameinfo_frame(info));
+	
+	if(may_repeat and imgux::frame_repeated(info)) // no payload follows
+	{
+		if(!last.empty() and output.data != last.data)
+			output = last;
+		return !sin.eof();
+	}
+	
+	if(format == imgux::pixel_format::jpeg) // the header's size is meaningless, every frame has its own
+	{
+		size_t length = 0;
+		sin.read((char*)&length, sizeof(length));
+		if(!sin)
+			return false;
+		output.create(1, (int)length, CV_8UC1);
+		sin.read((char*)output.ptr(), length);
+	}
+	else
+		sin.read((char*)output.ptr(), data_size);
+	
+	if(may_repeat)
+		last = output;
 	return !sin.eof();
 }
 
-bool imgux::frame_write(const cv::Mat& input, const frame_info& info, std::ostream& sout)
-{	
-	static std::unordered_map<const cv::Mat*, state_info> states;
-	state_info& state = states[&input];
-	
-	if(state.first)
-	{
-		state.first = false;
-		state.width = input.rows; // am i sure this is correct? seems to work
-		state.height = input.cols;
-		state.elm_size = input.elemSize();
-		state.type = input.type();
-		state.data_size = state.width * state.height * state.elm_size;
+bool imgux::reader::repeats() const
+{
+	return may_repeat;
+}
+
+// a source's empty damage= is a promise nothing changed; otherwise compare against the last frame we sent in full (not the last
+// repeat, so with a tolerance a slow drift still gets sent eventually)
+bool imgux::writer::repeated(const cv::Mat& input, const frame_info& info)
+{
+	imgux::trace_span span("repeat check");
+	bool same = !last.empty() and last.size() == input.size() and last.type() == input.type();
+	
+	if(same and imgux::frameinfo_has("damage", info) and imgux::frameinfo_rects("damage", info).empty())
+		return true;
+	
+	if(same and tolerance > 0)
+		same = cv::norm(input, last, cv::NORM_INF) <= tolerance;
+	else if(same) // memcmp is vectorized, and gives up at the first difference
+	{
+		size_t row = input.cols * input.elemSize();
+		for(int y = 0; y < input.rows and same; y++)
+			same = memcmp(input.ptr(y), last.ptr(y), row) == 0;
+	}
+	
+	if(!same)
+		input.copyTo(last);
+	return same;
+}
+
+bool imgux::frame_repeated(const imgux::frame_info& info)
+{
+	static const std::string marker = ";repeat=1";
+	return info.info.size() >= marker.size() and info.info.compare(info.info.size() - marker.size(), marker.size(), marker) == 0;
+}
+
+imgux::writer::writer(std::ostream& out) : out(&out)
+{
+}
+
+imgux::writer::writer(const std::string& spec) : owned(imgux::frame_open_output(spec)), out(owned.get())
+{
+}
+
+std::ostream& imgux::writer::stream()
+{
+	return *out;
+}
+
+bool imgux::writer::write(const cv::Mat& input, const frame_info& info)
+{
+	if(imgux::trace_enabled())
+		imgux::trace_frame(imgux::frameinfo_frame(info));
+	imgux::trace_span span("frame_write");
+	std::ostream& sout = *out;
+	
+	if(!started)
+	{
+		started = true;
+		width = input.rows; // am i sure this is correct? seems to work
+		height = input.cols;
+		elm_size = input.elemSize();
+		type = input.type();
+		data_size = width * height * elm_size;
+		format = info.format;
+		imgux::arguments_get("elide-repeats", elide);
+		imgux::arguments_get("repeat-tolerance", tolerance);
 		
-		sout << "opencv-mat\n";
-		sout.write((char*)&state.width, sizeof(state.width));
-		sout.write((char*)&state.height, sizeof(state.height));
-		sout.write((char*)&state.elm_size, sizeof(state.elm_size));
-		sout.write((char*)&state.type, sizeof(state.type));
+		sout << "opencv-mat";
+		if(format != imgux::pixel_format::mat)
+			sout << " " << imgux::pixel_format_name(format);
+		if(elide)
+			sout << " repeats";
+		sout << "\n";
+		sout.write((char*)&width, sizeof(width));
+		sout.write((char*)&height, sizeof(height));
+		sout.write((char*)&elm_size, sizeof(elm_size));
+		sout.write((char*)&type, sizeof(type));
+	}
+	
+	// an info passed on from a reader can still end in its stream's repeat marker, which in ours would say no payload follows
+	static const std::string marker = ";repeat=1";
+	size_t info_size = info.info.size();
+	if(imgux::frame_repeated(info))
+		info_size -= marker.size();
+	sout.write(info.info.data(), info_size);
+	
+	if(elide and repeated(input, info))
+	{
+		sout << marker << "\n";
+		sout.flush();
+		return !sout.bad();
+	}
+	
+	sout << "\n";
+	if(format == imgux::pixel_format::jpeg)
+	{
+		size_t length = input.total() * input.elemSize();
+		sout.write((const char*)&length, sizeof(length));
+		sout.write((const char*)input.ptr(), length); // imencode's output is always one continuous row
+	}
+	else if(input.isContinuous())
+		sout.write((const char*)input.ptr(), data_size);
+	else // a view into a bigger image, such as a pyramid level
+		for(int y = 0; y < input.rows; y++)
+			sout.write((const char*)input.ptr(y), input.cols * elm_size);
+	sout.flush(); // one record per flush, see fanout_streambuf
+	
+	return !sout.bad();
+}
+
+// for callers that only have the stream: its reader/writer is found by the stream's address, so a stream mustn't be
+// deleted and another read through these while it may have been given the same address
+bool imgux::frame_read(cv::Mat& output, frame_info& info, std::istream& sin)
+{
+	if(&sin == stream_in and default_reader)
+		return default_reader->read(output, info);
+	
+	static std::unordered_map<const std::istream*, std::unique_ptr<imgux::reader>> readers;
+	static std::mutex readers_lock;
+	
+	imgux::reader* rd;
+	{
+		std::lock_guard<std::mutex> lk(readers_lock);
+		std::unique_ptr<imgux::reader>& slot = readers[&sin];
+		if(!slot)
+			slot.reset(new imgux::reader(sin));
+		rd = slot.get();
+	}
+	return rd->read(output, info);
+}
+
+bool imgux::frame_write(const cv::Mat& input, const frame_info& info, std::ostream& sout)
+{
+	if(&sout == stream_out and default_writer)
+		return default_writer->write(input, info);
+	
+	static std::unordered_map<const std::ostream*, std::unique_ptr<imgux::writer>> writers;
+	static std::mutex writers_lock;
+	
+	imgux::writer* wr;
+	{
+		std::lock_guard<std::mutex> lk(writers_lock);
+		std::unique_ptr<imgux::writer>& slot = writers[&sout];
+		if(!slot)
+			slot.reset(new imgux::writer(sout));
+		wr = slot.get();
+	}
+	return wr->write(input, info);
+}
+
+
+// pyramids
+std::vector<cv::Rect> pyramid_rects(cv::Size level0, int levels)
+{
+	std::vector<cv::Rect> rects;
+	rects.push_back(cv::Rect(0, 0, level0.width, level0.height));
+	
+	cv::Size size = level0;
+	int y = 0;
+	for(int l = 1; l < levels; l++)
+	{
+		size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2); // what pyrDown produces
+		rects.push_back(cv::Rect(level0.width, y, size.width, size.height));
+		y += size.height;
 	}
 	
-	sout << info.info << "\n";
-	sout.write((const char*)input.ptr(), state.data_size);
+	return rects;
+}
+
+int imgux::frame_pyramid_levels(const imgux::frame_info& info)
+{
+	int levels = imgux::frameinfo_number("pyramid-levels", info);
+	return levels > 1 ? levels : 1;
+}
+
+cv::Mat imgux::frame_pyramid_level(const cv::Mat& frame, const imgux::frame_info& info, int level)
+{
+	int levels = imgux::frame_pyramid_levels(info);
+	if(levels == 1)
+		return frame;
+	
+	cv::Size level0(imgux::frameinfo_number("pyramid-width", info), imgux::frameinfo_number("pyramid-height", info));
+	std::vector<cv::Rect> rects = pyramid_rects(level0, levels);
+	
+	return frame(rects[std::min(std::max(level, 0), levels - 1)]);
+}
+
+void imgux::frame_pyramid_build(const cv::Mat& source, cv::Size size, int levels, cv::Mat& output, imgux::frame_info& info)
+{
+	std::vector<cv::Rect> rects = pyramid_rects(size, levels);
+	
+	int width = size.width + (levels > 1 ? rects[1].width : 0);
+	int height = std::max(size.height, rects.back().y + rects.back().height); // rounding up can make the stack taller
+	
+	uchar* old = output.data;
+	output.create(height, width, source.type());
+	if(output.data != old) // so the unused corner doesn't send garbage
+		output = cv::Scalar(0);
+	
+	// each level is written straight into its place, from the level above it
+	cv::Mat level0 = output(rects[0]);
+	if(source.size() == size)
+		source.copyTo(level0);
+	else
+		cv::resize(source, level0, size);
+	
+	for(int l = 1; l < levels; l++)
+	{
+		cv::Mat dst = output(rects[l]);
+		cv::pyrDown(output(rects[l - 1]), dst, rects[l].size());
+	}
+	
+	if(levels > 1)
+	{
+		std::stringstream ss;
+		ss << ";pyramid-levels=" << levels << ";pyramid-width=" << size.width << ";pyramid-height=" << size.height;
+		info.info += ss.str();
+	}
+}
+
+// pixel formats
+std::string imgux::pixel_format_name(imgux::pixel_format format)
+{
+	switch(format)
+	{
+		case pixel_format::gray: return "gray";
+		case pixel_format::nv12: return "nv12";
+		case pixel_format::i420: return "i420";
+		case pixel_format::jpeg: return "jpeg";
+		default: return "mat";
+	}
+}
+
+bool imgux::pixel_format_parse(const std::string& name, imgux::pixel_format& format)
+{
+	if(name == "mat" or name == "bgr")
+		format = pixel_format::mat;
+	else if(name == "gray" or name == "y")
+		format = pixel_format::gray;
+	else if(name == "nv12")
+		format = pixel_format::nv12;
+	else if(name == "i420" or name == "yuv420")
+		format = pixel_format::i420;
+	else if(name == "jpeg" or name == "mjpeg")
+		format = pixel_format::jpeg;
+	else
+		return false;
+	return true;
+}
+
+// finds the size in a JPEG's start of frame header, so we don't have to decode it to know
+cv::Size jpeg_size(const cv::Mat& jpeg)
+{
+	const uchar* data = jpeg.ptr();
+	size_t length = jpeg.total();
 	
-	return !sout.badbit;
+	size_t pos = 2; // past the SOI
+	while(pos + 9 < length)
+	{
+		if(data[pos] != 0xFF)
+			return cv::Size();
+		
+		uchar marker = data[pos + 1];
+		size_t segment = (data[pos + 2] << 8) | data[pos + 3];
+		
+		// SOF0 to SOF15, less DHT (C4), JPG (C8) and DAC (CC)
+		if(marker >= 0xC0 and marker <= 0xCF and marker != 0xC4 and marker != 0xC8 and marker != 0xCC)
+			return cv::Size((data[pos + 7] << 8) | data[pos + 8], (data[pos + 5] << 8) | data[pos + 6]);
+		
+		pos += 2 + segment;
+	}
+	return cv::Size();
+}
+
+cv::Size imgux::frame_image_size(const cv::Mat& frame, const imgux::frame_info& info)
+{
+	if(info.format == pixel_format::jpeg)
+		return jpeg_size(frame);
+	if(info.format == pixel_format::nv12 or info.format == pixel_format::i420)
+		return cv::Size(frame.cols, frame.rows * 2 / 3);
+	if(frame.channels() == 1 and imgux::frameinfo_string("flow-layout", info) == "planar") // x plane above the y plane
+		return cv::Size(frame.cols, frame.rows / 2);
+	return frame.size();
 }
 
+cv::Mat imgux::frame_as_bgr(const cv::Mat& frame, const imgux::frame_info& info, cv::Mat& scratch)
+{
+	switch(info.format)
+	{
+		case pixel_format::nv12: cv::cvtColor(frame, scratch, CV_YUV2BGR_NV12); return scratch;
+		case pixel_format::i420: cv::cvtColor(frame, scratch, CV_YUV2BGR_I420); return scratch;
+		case pixel_format::jpeg: scratch = cv::imdecode(frame, cv::IMREAD_COLOR); return scratch;
+		default:
+			if(frame.channels() == 1)
+			{
+				cv::cvtColor(frame, scratch, CV_GRAY2BGR);
+				return scratch;
+			}
+			return frame;
+	}
+}
+
+cv::Mat imgux::frame_as_gray(const cv::Mat& frame, const imgux::frame_info& info, cv::Mat& scratch)
+{
+	switch(info.format)
+	{
+		case pixel_format::nv12:
+		case pixel_format::i420:
+			return frame.rowRange(0, frame.rows * 2 / 3); // the Y plane is already luma
+		case pixel_format::jpeg:
+			scratch = cv::imdecode(frame, cv::IMREAD_GRAYSCALE); // libjpeg skips the chroma entirely
+			return scratch;
+		default:
+			if(frame.channels() == 3)
+			{
+				cv::cvtColor(frame, scratch, CV_BGR2GRAY);
+				return scratch;
+			}
+			return frame;
+	}
+}
@@ -3,7 +3,9 @@
 
 // STL
 #include <iostream>
+#include <memory>
 #include <cassert>
+#include <cstdint>
 
 // OpenCV
 #include <opencv2/opencv.hpp>
@@ -24,24 +26,147 @@ namespace imgux
 	void arguments_parse(int argc, char** argv);
 	
 	
+	// tracing: --trace=file.json writes Chrome trace events (chrome://tracing, Perfetto) for spans of work
+	// times are the system clock and every span carries its frame number, so the traces of a pipeline's processes can be merged
+	bool trace_enabled();
+	int64_t trace_now(); // microseconds
+	void trace_frame(size_t frame); // spans on this thread belong to this frame from now on (frame_read/frame_write do this)
+	void trace_record(const char* name, int64_t start);
+	
+	class trace_span // from construction to destruction; a branch is all it costs when tracing is off
+	{
+	public:
+		trace_span(const char* name) : name(imgux::trace_enabled() ? name : nullptr), start(this->name ? imgux::trace_now() : 0)
+		{
+		}
+		~trace_span()
+		{
+			end();
+		}
+		void end()
+		{
+			if(name)
+				imgux::trace_record(name, start);
+			name = nullptr;
+		}
+		void next(const char* name) // end this span and start another, for a function's phases
+		{
+			if(!this->name)
+				return;
+			end();
+			this->name = name;
+			start = imgux::trace_now();
+		}
+	private:
+		const char* name;
+		int64_t start;
+	};
+	
+	
 	// frame stuffs
+	
+	// how the pixels of a frame are laid out, carried in the stream header
+	enum class pixel_format
+	{
+		mat,  // whatever the cv::Mat's type says (CV_8UC3 is BGR)
+		gray, // CV_8UC1 luma
+		nv12, // CV_8UC1, height * 3/2 rows: the Y plane, then interleaved UV at half resolution
+		i420, // CV_8UC1, height * 3/2 rows: the Y plane, then the U and V planes at half resolution
+		jpeg  // CV_8UC1, 1 row: a whole JPEG file, decoded only by whoever needs the pixels (each record carries its length)
+	};
+	
 	struct frame_info // infomration that may not be part of the image, but usefull
 	{
 		std::string info;
+		pixel_format format = pixel_format::mat;
+	};
+	
+	// one stream of frames each; they own all of the stream's state (nothing is shared between them), so different streams
+	// can be read and written from different threads without any locking, but a single one mustn't be used by two at once
+	class reader
+	{
+	public:
+		reader(std::istream& in); // in must outlive the reader
+		reader(const std::string& spec); // opened like --input
+		
+		// a repeat record leaves output sharing the last payload read, rather than copying it; see frame_repeated
+		bool read(cv::Mat& output, imgux::frame_info& info);
+		std::istream& stream();
+		bool repeats() const; // may the writer send repeat records? if so, don't draw on what you read without copying it
+	private:
+		std::unique_ptr<std::istream> owned;
+		std::istream* in;
+		bool started = false;
+		int width = 0, height = 0;
+		size_t elm_size = 0, type = 0, data_size = 0;
+		pixel_format format = pixel_format::mat;
+		bool may_repeat = false;
+		cv::Mat last;
+	};
+	
+	class writer
+	{
+	public:
+		writer(std::ostream& out); // out must outlive the writer
+		writer(const std::string& spec); // opened like --output
+		
+		bool write(const cv::Mat& input, const imgux::frame_info& info);
+		std::ostream& stream();
+	private:
+		std::unique_ptr<std::ostream> owned;
+		std::ostream* out;
+		bool started = false;
+		int width = 0, height = 0;
+		size_t elm_size = 0, type = 0, data_size = 0;
+		pixel_format format = pixel_format::mat;
+		bool elide = false; // --elide-repeats
+		double tolerance = 0;
+		cv::Mat last;
+		
+		bool repeated(const cv::Mat& input, const imgux::frame_info& info);
 	};
 	
 	void frame_setup();
 	void frame_close();
 	std::istream* frame_default_input();
 	std::ostream* frame_default_output();
+	imgux::reader* frame_default_reader();
+	imgux::writer* frame_default_writer();
+	
+	// open a stream the same way frame_setup does for --input/--output, caller owns the result
+	// outputs may be a comma separated list of sinks (e.g. a.pipe,b.pipe:drop); each frame is serialized once and shared,
+	// and each sink has its own queue and policy: block (default), drop (the new frame), latest (the oldest queued frame)
+	std::istream* frame_open_input(const std::string& spec);
+	std::ostream* frame_open_output(const std::string& spec);
 	
 	// generic things to read frame infos
 	double frameinfo_time(const imgux::frame_info& info);
 	size_t frameinfo_frame(const imgux::frame_info& info);
 	double frameinfo_number(std::string name, const imgux::frame_info& info);
 	std::string frameinfo_string(std::string name, const imgux::frame_info& info);
+	bool frameinfo_has(std::string name, const imgux::frame_info& info);
+	void frameinfo_remove(std::string name, imgux::frame_info& info);
+	// rects are stored as x,y,w,h|x,y,w,h|...
+	std::vector<cv::Rect> frameinfo_rects(std::string name, const imgux::frame_info& info);
+	
+	// pyramids: every level packed into one frame, level 0 on the left and the rest stacked top to bottom on its right,
+	// described by pyramid-levels, pyramid-width and pyramid-height in the info; levels are views into the frame, not copies
+	int frame_pyramid_levels(const imgux::frame_info& info); // 1 if the frame isn't a pyramid
+	cv::Mat frame_pyramid_level(const cv::Mat& frame, const imgux::frame_info& info, int level);
+	void frame_pyramid_build(const cv::Mat& source, cv::Size size, int levels, cv::Mat& output, imgux::frame_info& info);
+	
+	// convert only if needed; the result is either frame itself, a view into it, or scratch
+	cv::Mat frame_as_bgr(const cv::Mat& frame, const imgux::frame_info& info, cv::Mat& scratch);
+	cv::Mat frame_as_gray(const cv::Mat& frame, const imgux::frame_info& info, cv::Mat& scratch);
+	cv::Size frame_image_size(const cv::Mat& frame, const imgux::frame_info& info); // the picture's size, not the buffer's
+	std::string pixel_format_name(pixel_format format);
+	bool pixel_format_parse(const std::string& name, pixel_format& format);
+	
+	// with --elide-repeats, a frame that's the same as the last one written is sent as just its info with ;repeat=1 on the end
+	bool frame_repeated(const imgux::frame_info& info);
 	
 	// opencv
+	// these look up a reader/writer for the stream each call (behind a lock), prefer holding an imgux::reader/writer
 	bool frame_read(cv::Mat& output, imgux::frame_info& info, std::istream& instream);
 	bool frame_write(const cv::Mat& input, const imgux::frame_info& info, std::ostream& ostream);
 	
@@ -49,15 +174,15 @@ namespace imgux
 	template<typename T>
 	inline bool frame_read(T& output, frame_info& info)
 	{
-		assert(imgux::frame_default_input() != nullptr);
-		return imgux::frame_read(output, info, *imgux::frame_default_input());
+		assert(imgux::frame_default_reader() != nullptr);
+		return imgux::frame_default_reader()->read(output, info);
 	}
 	
 	template<typename T>
 	inline bool frame_write(const T& input, const frame_info& info)
 	{
-		assert(imgux::frame_default_output() != nullptr);
-		return imgux::frame_write(input, info, *imgux::frame_default_output());
+		assert(imgux::frame_default_writer() != nullptr);
+		return imgux::frame_default_writer()->write(input, info);
 	}
 	
 }
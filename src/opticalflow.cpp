@@ -5,6 +5,15 @@
 #include <string>
 #include <sstream>
 #include <regex>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp>
@@ -12,6 +21,8 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/gpu/gpu.hpp>
 
+#include "pool.hpp"
+
 static void HSVtoRGB(double h, double s, double v, double& r, double& g, double& b)
 {
 	h /= 360.0;
@@ -81,32 +92,153 @@ double pyr_scale; int levels; int winsize; int iterations; int poly_n; double po
 bool colourize, visualize;
 std::string visualize_out;
 double s = 1.0;
+double deadline_ms = 0;
+bool flow_fixed = false; // --flow-format=int16
+double flow_quant = 16;
+double roi_sweep = 0.25; // --roi-sweep-scale
+double roi_timeout = 1.0;
+std::string global_motion = "none"; // none|translation|affine
+int global_motion_step = 8;
 
-void do_stuff_with_flow(const cv::Mat& flow, const cv::Mat& next, const imgux::frame_info& info)
+// builds the colourized flow if anything is going to want it
+void colourize_for_output(const cv::Mat& flow, const cv::Mat& next, cv::Mat& cflow)
 {
 	if(colourize || visualize)
 	{
-		cv::Mat cflow;
+		imgux::trace_span span("colorizeFlow");
 		cv::cvtColor(next, cflow, CV_GRAY2BGR);
-		
 		colorizeFlow(flow, cflow);
-		
-		if(colourize)
-			imgux::frame_write(cflow, info);
-		if(visualize and visualize_out != "")
+	}
+}
+
+// planar int16: the x plane then the y plane, flow_quant units per pixel; half the size of CV_32FC2, and
+// flow-motiontrack thresholds it without going back to float
+void write_fixed_flow(const cv::Mat& flow, const imgux::frame_info& info, imgux::writer& out)
+{
+	static thread_local std::vector<cv::Mat> planes;
+	static thread_local cv::Mat packed;
+	
+	cv::split(flow, planes);
+	packed.create(flow.rows * 2, flow.cols, CV_16SC1);
+	cv::Mat x = packed.rowRange(0, flow.rows), y = packed.rowRange(flow.rows, flow.rows * 2);
+	planes[0].convertTo(x, CV_16S, flow_quant); // saturates
+	planes[1].convertTo(y, CV_16S, flow_quant);
+	
+	std::stringstream ss;
+	ss << ";flow-layout=planar;flow-quant=" << flow_quant;
+	imgux::frame_info fixed_info = info;
+	fixed_info.info += ss.str();
+	fixed_info.format = imgux::pixel_format::mat;
+	out.write(packed, fixed_info);
+}
+
+// writes the flow (or its colourized version) to out, and the visualization to vis_out or a window
+void write_flow(const cv::Mat& flow, const cv::Mat& cflow, const imgux::frame_info& frame_info, imgux::writer& out, imgux::writer* vis_out)
+{
+	// the info came with the input frame, but whatever its pixel format was, the flow and its colourization are plain mats
+	imgux::frame_info info = frame_info;
+	info.format = imgux::pixel_format::mat;
+	imgux::frameinfo_remove("damage", info); // an unchanged frame is zero flow, which isn't unchanged from the last flow
+	
+	if(colourize)
+		out.write(cflow, info);
+	if(visualize and vis_out)
+		vis_out->write(cflow, info);
+	else if(visualize)
+	{
+		cv::imshow("Optical Flow", cflow);
+		cv::waitKey(1);
+	}
+	
+	if(!colourize and flow_fixed)
+		write_fixed_flow(flow, info, out);
+	else if(!colourize)
+		out.write(flow, info);
+}
+
+// when the camera pans or shakes everything moves, and the tracker would see one frame sized blob; estimate the camera's
+// motion from a sparse grid of vectors (the median, or a RANSAC affine fit that also covers zoom and roll), take it out of
+// the flow, and note what it was as global-motion (the vector at the centre) and global-affine (x' = a*x + b*y + c, y' = d*x + e*y + f)
+void compensate_global_motion(cv::Mat& flow, imgux::frame_info& info)
+{
+	if(global_motion == "none")
+		return;
+	
+	imgux::trace_span span("global motion");
+	const double units = 15.0; // the flow is 15x the displacement in the output's pixels, see velocity_scale
+	bool affine = global_motion == "affine";
+	
+	static thread_local std::vector<float> xs, ys;
+	static thread_local std::vector<cv::Point2f> from, to;
+	xs.clear();
+	ys.clear();
+	from.clear();
+	to.clear();
+	
+	int step = std::max(global_motion_step, 1);
+	for(int y = step / 2; y < flow.rows; y += step)
+	{
+		const cv::Point2f* row = flow.ptr<cv::Point2f>(y);
+		for(int x = step / 2; x < flow.cols; x += step)
 		{
-			static std::ofstream vo(visualize_out);
-			imgux::frame_write(cflow, info, vo);
+			xs.push_back(row[x].x);
+			ys.push_back(row[x].y);
+			if(affine)
+			{
+				from.push_back(cv::Point2f(x, y));
+				to.push_back(cv::Point2f(x + row[x].x / units, y + row[x].y / units));
+			}
 		}
-		else if(visualize)
+	}
+	if(xs.empty())
+		return;
+	
+	// the median only goes wrong once the movers cover most of the frame
+	size_t mid = xs.size() / 2;
+	std::nth_element(xs.begin(), xs.begin() + mid, xs.end());
+	std::nth_element(ys.begin(), ys.begin() + mid, ys.end());
+	double a[6] = {1, 0, xs[mid] / units, 0, 1, ys[mid] / units};
+	
+	if(affine and from.size() >= 3)
+	{
+		cv::Mat fit = cv::estimateRigidTransform(from, to, true);
+		if(!fit.empty()) // no consensus, the translation will have to do
+			for(int i = 0; i < 6; i++)
+				a[i] = fit.at<double>(i / 3, i % 3);
+	}
+	
+	// the field the camera alone would produce is (A - I) * (x, y, 1)
+	for(int y = 0; y < flow.rows; y++)
+	{
+		cv::Point2f* row = flow.ptr<cv::Point2f>(y);
+		double gx = (a[1] * y + a[2]) * units, gy = ((a[4] - 1.0) * y + a[5]) * units;
+		double dx = (a[0] - 1.0) * units, dy = a[3] * units;
+		for(int x = 0; x < flow.cols; x++)
 		{
-			cv::imshow("Optical Flow", cflow);
-			cv::waitKey(1);
+			row[x].x -= gx + dx * x;
+			row[x].y -= gy + dy * x;
 		}
 	}
 	
-	if(!colourize)
-		imgux::frame_write(flow, info);
+	double cx = flow.cols / 2.0, cy = flow.rows / 2.0;
+	std::stringstream ss;
+	ss << ";global-motion=" << ((a[0] - 1.0) * cx + a[1] * cy + a[2]) * units << "," << (a[3] * cx + (a[4] - 1.0) * cy + a[5]) * units;
+	if(affine)
+		ss << ";global-affine=" << a[0] << "," << a[1] << "," << a[2] << "," << a[3] << "," << a[4] << "," << a[5];
+	info.info += ss.str();
+}
+
+void do_stuff_with_flow(cv::Mat& flow, const cv::Mat& next, imgux::frame_info& info, imgux::writer& out, imgux::writer* vis_out, cv::Mat& cflow)
+{
+	compensate_global_motion(flow, info);
+	colourize_for_output(flow, next, cflow);
+	write_flow(flow, cflow, info, out, vis_out);
+}
+
+imgux::writer* default_visualize_output()
+{
+	static std::unique_ptr<imgux::writer> vo(visualize_out != "" ? new imgux::writer(visualize_out) : nullptr);
+	return vo.get();
 }
 
 int main_gpu()
@@ -129,10 +261,33 @@ int main_gpu()
 	// read frame
 	imgux::frame_read(GetImg, info);
 	
+	// luma sources only need the Y plane uploading, and no colour conversion
+	// of a pyramid source only the full size level is uploaded, and its keys are the source's business, not the flow's
+	cv::Mat luma_scratch;
+	cv::Size size = imgux::frame_image_size(imgux::frame_pyramid_level(GetImg, info, 0), info);
+	size = cv::Size(size.width/s, size.height/s);
+	auto upload = [&](cv::gpu::GpuMat& uploaded, cv::gpu::GpuMat& scaled, cv::gpu::GpuMat& gray)
+	{
+		cv::Mat base = imgux::frame_pyramid_level(GetImg, info, 0);
+		imgux::frameinfo_remove("pyramid-levels", info);
+		imgux::frameinfo_remove("pyramid-width", info);
+		imgux::frameinfo_remove("pyramid-height", info);
+		
+		if(base.channels() == 3)
+		{
+			uploaded.upload(base);
+			cv::gpu::resize(uploaded, scaled, size);
+			cv::gpu::cvtColor(scaled, gray, CV_BGR2GRAY);
+		}
+		else
+		{
+			uploaded.upload(imgux::frame_as_gray(base, info, luma_scratch));
+			cv::gpu::resize(uploaded, gray, size);
+		}
+	};
+	
 	//gpu upload, resize, color convert
-	prvs_gpu_o.upload(GetImg);
-	cv::gpu::resize(prvs_gpu_o, prvs_gpu_c, cv::Size(GetImg.size().width/s, GetImg.size().height/s) );
-	cv::gpu::cvtColor(prvs_gpu_c, prvs_gpu, CV_BGR2GRAY);
+	upload(prvs_gpu_o, prvs_gpu_c, prvs_gpu);
 	
 	bool use_farneback = true;
 	
@@ -156,7 +311,7 @@ int main_gpu()
 	*/
 	
 	cv::Mat flow;
-	flow.create(cv::Size(GetImg.size().width/s, GetImg.size().height/s), CV_32FC2);
+	flow.create(size, CV_32FC2);
 	
 	//unconditional loop
 	while (true)
@@ -164,10 +319,20 @@ int main_gpu()
 		if(!imgux::frame_read(GetImg, info))
 			break;
 		
-		next_gpu_o.upload(GetImg);
+		static cv::Mat cflow;
+		// nothing moved (a repeat, or the source says nothing was damaged), and prvs_gpu is still the right frame
+		bool unchanged = imgux::frame_repeated(info) or (imgux::frameinfo_has("damage", info) and imgux::frameinfo_rects("damage", info).empty());
+		if(unchanged and !next.empty())
+		{
+			imgux::frameinfo_remove("pyramid-levels", info);
+			imgux::frameinfo_remove("pyramid-width", info);
+			imgux::frameinfo_remove("pyramid-height", info);
+			flow = cv::Scalar::all(0);
+			do_stuff_with_flow(flow, next, info, *imgux::frame_default_writer(), default_visualize_output(), cflow);
+			continue;
+		}
 		
-		cv::gpu::resize(next_gpu_o, next_gpu_c, cv::Size(GetImg.size().width/s, GetImg.size().height/s) );
-		cv::gpu::cvtColor(next_gpu_c, next_gpu, CV_BGR2GRAY);
+		upload(next_gpu_o, next_gpu_c, next_gpu);
 		
 		if(use_farneback)
 			farneback_flow(prvs_gpu, next_gpu, flow_x_gpu, flow_y_gpu);
@@ -199,54 +364,784 @@ int main_gpu()
 			vec.y = fy * 15.0;
 		}
 		
-		do_stuff_with_flow(flow, next, info);
+		do_stuff_with_flow(flow, next, info, *imgux::frame_default_writer(), default_visualize_output(), cflow);
 	}
 	
 	return 0;
 }
 
-int main_cpu()
+// luma at the given size into gray (which always gets its own buffer), converting only if the frame isn't luma already
+void gray_at_size(const cv::Mat& base, const imgux::frame_info& info, cv::Size size, cv::Mat& gray, cv::Mat& scratch)
 {
-	imgux::frame_info info;
+	if(base.channels() == 3)
+	{
+		if(base.size() != size)
+		{
+			imgux::trace_span span("resize");
+			cv::resize(base, scratch, size);
+		}
+		imgux::trace_span span("cvtColor");
+		cv::cvtColor(base.size() == size ? base : scratch, gray, CV_BGR2GRAY);
+		return;
+	}
 	
-	std::stringstream ss;
-	std::string frameinfo_ext;
+	cv::Mat luma = imgux::frame_as_gray(base, info, scratch);
+	imgux::trace_span span("resize");
+	if(luma.size() == size)
+		luma.copyTo(gray);
+	else
+		cv::resize(luma, gray, size);
+}
+
+// picks Farneback parameters each frame so the frame fits in --deadline-ms
+// cost is modelled as k * pixels * pyramid area * (iterations + 1), with k measured as we go
+struct quality_controller
+{
+	struct rung
+	{
+		double scale; // relative to the --scale'd frame
+		int levels, winsize, iterations;
+		double units;
+	};
 	
-	ss << ";flow-winsize=" << std::fixed << winsize << ";";
-	frameinfo_ext = ss.str();	
+	std::vector<rung> rungs; // most expensive (best) first
+	size_t current = 0;
+	double deadline = 0;
+	double k = 0, overhead = 0;
+	bool measured = false;
+	
+	void setup(double deadline_ms, cv::Size size)
+	{
+		deadline = deadline_ms;
+		rungs.clear();
 		
-	cv::Mat GetImg;
-	cv::Mat prvs, next;
+		if(deadline <= 0) // fixed quality
+		{
+			rungs.push_back(rung{1.0, levels, winsize, iterations, 1.0});
+			return;
+		}
+		
+		for(double f : {1.0, 0.85, 0.7, 0.6, 0.5, 0.4, 0.3, 0.25})
+		for(int it = iterations; it >= 1; it--)
+		for(int lv = levels; lv >= 1; lv--)
+		{
+			double pyr = 0;
+			for(int l = 0; l < lv; l++)
+				pyr += std::pow(pyr_scale, 2 * l);
+			
+			rung r;
+			r.scale = f;
+			r.levels = lv;
+			r.iterations = it;
+			r.winsize = std::max(3, (int)std::round(winsize * f)); // cover the same area of the scene
+			r.units = (double)size.area() * f * f * pyr * (it + 1);
+			rungs.push_back(r);
+		}
+		
+		std::stable_sort(rungs.begin(), rungs.end(), [](const rung& a, const rung& b)
+		{
+			return a.units > b.units;
+		});
+	}
 	
-	imgux::frame_read(GetImg, info);
-	cv::resize(GetImg, prvs, cv::Size(GetImg.size().width/s, GetImg.size().height/s));
-	cv::cvtColor(prvs, prvs, CV_BGR2GRAY);
+	const rung& params() const
+	{
+		return rungs[current];
+	}
 	
-	while (true)
+	void update(double flow_ms, double total_ms)
 	{
-		if(!imgux::frame_read(GetImg, info))
-			break;
-		cv::resize(GetImg, next, cv::Size(GetImg.size().width/s, GetImg.size().height/s) );
-		cv::cvtColor(next, next, CV_BGR2GRAY);		
+		if(deadline <= 0)
+			return;
 		
-		info.info += frameinfo_ext;
+		double k_now = flow_ms / rungs[current].units;
+		double overhead_now = std::max(0.0, total_ms - flow_ms);
+		
+		k = measured ? 0.8 * k + 0.2 * k_now : k_now;
+		overhead = measured ? 0.8 * overhead + 0.2 * overhead_now : overhead_now;
+		measured = true;
+		
+		double budget = deadline - overhead;
+		size_t best = rungs.size() - 1;
+		
+		for(size_t i = 0; i < rungs.size(); i++)
+		{
+			// leave some headroom before raising the quality again, so we don't oscillate
+			double allowed = i < current ? budget * 0.8 : budget;
+			if(k * rungs[i].units <= allowed)
+			{
+				best = i;
+				break;
+			}
+		}
+		
+		// drop straight to what fits, but only climb back one rung at a time
+		current = best < current ? current - 1 : best;
+	}
+};
+
+// where flow-motiontrack --roi-output expects its targets to be next frame, one line per flow frame:
+// "time=T;width=W;height=H;rois=x,y,w,h|..." in the flow's pixels; read on its own thread so we never wait on the tracker
+struct roi_feed
+{
+	std::string spec;
+	std::mutex lock;
+	std::vector<cv::Rect> rois;
+	cv::Size space;
+	std::chrono::steady_clock::time_point updated;
+	bool received = false;
+	
+	roi_feed(const std::string& spec) : spec(spec)
+	{
+		// the thread lives as long as the process (it may be blocked reading from a tracker that never writes), so we do too
+		std::thread([this]
+		{
+			std::unique_ptr<std::istream> in(imgux::frame_open_input(this->spec)); // a FIFO blocks until the tracker opens it
+			std::string line;
+			
+			while(std::getline(*in, line))
+			{
+				imgux::frame_info info;
+				info.info = line;
+				std::vector<cv::Rect> latest = imgux::frameinfo_rects("rois", info);
+				cv::Size latest_space(imgux::frameinfo_number("width", info), imgux::frameinfo_number("height", info));
+				
+				std::lock_guard<std::mutex> lk(this->lock);
+				this->rois.swap(latest);
+				this->space = latest_space;
+				this->updated = std::chrono::steady_clock::now();
+				this->received = true;
+			}
+			
+			std::cerr << "opticalflow: roi input " << this->spec << " closed, computing whole frames\n";
+			std::lock_guard<std::mutex> lk(this->lock);
+			this->received = false;
+		}).detach();
+	}
+	
+	// the latest regions scaled to size, or false if the tracker hasn't told us anything recently enough to trust
+	bool get(cv::Size size, std::vector<cv::Rect>& out)
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		if(!received or space.area() <= 0)
+			return false;
+		if(std::chrono::duration<double>(std::chrono::steady_clock::now() - updated).count() > roi_timeout)
+			return false;
 		
-		cv::Mat flow;
+		double fx = (double)size.width / space.width, fy = (double)size.height / space.height;
+		out.clear();
+		for(const cv::Rect& r : rois)
+		{
+			cv::Rect scaled = cv::Rect(r.x * fx, r.y * fy, std::ceil(r.width * fx), std::ceil(r.height * fy)) & cv::Rect(0, 0, size.width, size.height);
+			if(scaled.area() > 0)
+				out.push_back(scaled);
+		}
+		return true;
+	}
+};
+
+// everything needed to turn one stream of frames into a stream of flow
+struct flow_stream
+{
+	std::string name;
+	imgux::reader* in = nullptr;
+	imgux::writer* out = nullptr;
+	imgux::writer* vis_out = nullptr;
+	roi_feed* rois_in = nullptr;
+	
+	cv::Mat GetImg, prvs, next, prvs_eff, next_eff, flow_eff, flow, cflow;
+	cv::Size size;
+	quality_controller controller;
+	bool started = false;
+	
+	// stats, latency is from the frame being read to its flow being written
+	size_t frames = 0;
+	double latency_total = 0, latency_max = 0;
+	
+	std::vector<cv::Mat> prvs_pyr, next_pyr;
+	cv::Mat scaled;
+	
+	std::vector<cv::Rect> rois;
+	cv::Mat prvs_sweep, next_sweep, flow_roi;
+	
+	// the smallest level of a pyramid frame that's still at least size, or the frame itself
+	static cv::Mat pick_level(const cv::Mat& frame, const imgux::frame_info& info, cv::Size size, int& picked)
+	{
+		int levels = imgux::frame_pyramid_levels(info);
+		picked = 0;
 		
-		cv::calcOpticalFlowFarneback(prvs, next, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, 0);// | cv::OPTFLOW_FARNEBACK_GAUSSIAN);
-		//cv::calcOpticalFlowSF(prvs, next, flow, 3, 2, 4, 4.1, 25.5, 18, 55.0, 25.5, 0.35, 18, 55.0, 25.5, 10); // super slow but accurate
+		while(picked + 1 < levels)
+		{
+			cv::Size next = imgux::frame_pyramid_level(frame, info, picked + 1).size();
+			if(next.width < size.width or next.height < size.height)
+				break;
+			picked++;
+		}
+		
+		return imgux::frame_pyramid_level(frame, info, picked);
+	}
+	
+	// can we run Farneback's pyramid ourselves from the source's levels? they have to be exact halvings below our size
+	static bool use_pyramid(const cv::Mat& frame, const imgux::frame_info& info, int picked, cv::Size size)
+	{
+		return levels > 1 and pyr_scale == 0.5 and imgux::frame_pyramid_levels(info) - picked >= levels
+			and imgux::frame_pyramid_level(frame, info, picked).size() == size;
+	}
+	
+	static void gray_levels(const cv::Mat& frame, const imgux::frame_info& info, int picked, std::vector<cv::Mat>& out, cv::Mat& scaled)
+	{
+		out.resize(levels);
+		for(int l = 0; l < levels; l++)
+		{
+			cv::Mat level = imgux::frame_pyramid_level(frame, info, picked + l);
+			gray_at_size(level, info, level.size(), out[l], scaled);
+		}
+	}
+	
+	// what calcOpticalFlowFarneback does with levels > 1, but on levels we were given rather than ones it builds
+	static void pyramid_flow(const std::vector<cv::Mat>& prvs_pyr, const std::vector<cv::Mat>& next_pyr, cv::Mat& flow, int levels, int winsize, int iterations)
+	{
+		cv::Mat up;
+		flow = cv::Mat();
+		
+		for(int l = levels - 1; l >= 0; l--)
+		{
+			int flags = 0;
+			if(!flow.empty())
+			{
+				cv::resize(flow, up, prvs_pyr[l].size());
+				up.convertTo(flow, -1, 2.0); // vectors double with the resolution
+				flags = cv::OPTFLOW_USE_INITIAL_FLOW;
+			}
+			cv::calcOpticalFlowFarneback(prvs_pyr[l], next_pyr[l], flow, pyr_scale, 1, winsize, iterations, poly_n, poly_sigma, flags);
+		}
+	}
+	
+	// a cheap low resolution pass over the whole frame so new targets still show up, then full quality flow
+	// over each region the tracker is interested in (with some context around it, as Farneback's edges are poor)
+	void roi_flow(const std::vector<cv::Rect>& regions)
+	{
+		cv::Size sweep_size(std::max(1, (int)std::round(size.width * roi_sweep)), std::max(1, (int)std::round(size.height * roi_sweep)));
+		{
+			imgux::trace_span span("resize");
+			cv::resize(next, next_sweep, sweep_size, 0, 0, cv::INTER_AREA);
+			if(prvs_sweep.size() != sweep_size)
+				cv::resize(prvs, prvs_sweep, sweep_size, 0, 0, cv::INTER_AREA);
+		}
+		
+		imgux::trace_span span("farneback");
+		int sweep_winsize = std::max(3, (int)std::round(winsize * roi_sweep));
+		cv::calcOpticalFlowFarneback(prvs_sweep, next_sweep, flow_eff, pyr_scale, std::max(1, levels - 1), sweep_winsize, iterations, poly_n, poly_sigma, 0);
+		cv::resize(flow_eff, flow, size);
+		flow.convertTo(flow, -1, 15.0 / roi_sweep);
+		cv::swap(prvs_sweep, next_sweep);
+		
+		span.next("farneback roi");
+		int context = winsize * 2;
+		for(const cv::Rect& r : regions)
+		{
+			cv::Rect outer = cv::Rect(r.x - context, r.y - context, r.width + 2 * context, r.height + 2 * context) & cv::Rect(0, 0, size.width, size.height);
+			cv::calcOpticalFlowFarneback(prvs(outer), next(outer), flow_roi, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, 0);
+			
+			cv::Mat inner = flow(r);
+			flow_roi(cv::Rect(r.x - outer.x, r.y - outer.y, r.width, r.height)).convertTo(inner, -1, 15.0);
+		}
+	}
+	
+	// returns false if this was the first frame, which only primes prvs
+	bool process(const cv::Mat& frame, imgux::frame_info& info)
+	{
+		int picked = 0;
+		
+		if(!started)
+		{
+			started = true;
+			cv::Size full = imgux::frame_image_size(imgux::frame_pyramid_level(frame, info, 0), info);
+			size = cv::Size(full.width/s, full.height/s);
+			gray_at_size(pick_level(frame, info, size, picked), info, size, prvs, scaled);
+			if(use_pyramid(frame, info, picked, size))
+				gray_levels(frame, info, picked, prvs_pyr, scaled);
+			controller.setup(deadline_ms, size);
+			return false;
+		}
+		
+		auto start = std::chrono::steady_clock::now();
+		const quality_controller::rung& p = controller.params();
+		
+		// the source's pyramid is only useful to us, don't let it confuse whoever reads the flow
+		imgux::frameinfo_remove("pyramid-levels", info);
+		imgux::frameinfo_remove("pyramid-width", info);
+		imgux::frameinfo_remove("pyramid-height", info);
+		
+		// winsize is reported in the output's pixels so readers don't need to care about the scale we ran at
+		std::stringstream ss;
+		ss << std::fixed << ";flow-winsize=" << p.winsize / p.scale << ";flow-scale=" << p.scale
+			<< ";flow-levels=" << p.levels << ";flow-iterations=" << p.iterations << ";";
+		
+		// the source told us nothing changed since the last frame (or it's a repeat record), so there is no motion to find
+		if(imgux::frame_repeated(info) or (imgux::frameinfo_has("damage", info) and imgux::frameinfo_rects("damage", info).empty()))
+		{
+			info.info += ss.str();
+			flow = cv::Mat::zeros(prvs.size(), CV_32FC2);
+			do_stuff_with_flow(flow, prvs, info, *out, vis_out, cflow);
+			return true;
+		}
 		
-		prvs = next.clone();
+		cv::Mat base = pick_level(frame, info, size, picked);
+		bool pyramid = use_pyramid(frame, info, picked, size) and p.scale == 1.0 and (int)prvs_pyr.size() >= p.levels;
+		
+		// the tracker knows where to look: the regions get the configured quality (not the deadline's), the rest a sweep
+		if(rois_in and rois_in->get(size, rois))
+		{
+			std::stringstream rs;
+			rs << std::fixed << ";flow-winsize=" << winsize << ";flow-scale=1;flow-levels=" << levels << ";flow-iterations=" << iterations
+				<< ";flow-sweep-scale=" << roi_sweep << ";flow-rois=" << rois.size() << ";";
+			info.info += rs.str();
+			
+			gray_at_size(base, info, size, next, scaled);
+			roi_flow(rois);
+			
+			if(use_pyramid(frame, info, picked, size))
+			{
+				gray_levels(frame, info, picked, next_pyr, scaled);
+				next_pyr[0] = next;
+				std::swap(prvs_pyr, next_pyr);
+			}
+			cv::swap(prvs, next);
+			prvs_eff = cv::Mat(); // the scale may have changed while we weren't using it
+			
+			do_stuff_with_flow(flow, prvs, info, *out, vis_out, cflow);
+			return true;
+		}
+		prvs_sweep = cv::Mat();
+		
+		info.info += ss.str();
+		
+		gray_at_size(base, info, size, next, scaled);
+		
+		if(pyramid)
+		{
+			gray_levels(frame, info, picked, next_pyr, scaled);
+			next_pyr[0] = next;
+			
+			auto flow_start = std::chrono::steady_clock::now();
+			{
+				imgux::trace_span span("farneback");
+				pyramid_flow(prvs_pyr, next_pyr, flow, p.levels, p.winsize, p.iterations);
+			}
+			auto flow_end = std::chrono::steady_clock::now();
+			
+			std::swap(prvs_pyr, next_pyr);
+			cv::swap(prvs, next);
+			
+			flow.convertTo(flow, -1, 15.0);
+			
+			// before the write, which can wait on a slow reader, and that's no reason to lower the quality
+			auto end = std::chrono::steady_clock::now();
+			controller.update(std::chrono::duration<double, std::milli>(flow_end - flow_start).count(), std::chrono::duration<double, std::milli>(end - start).count());
+			
+			do_stuff_with_flow(flow, prvs, info, *out, vis_out, cflow);
+			return true;
+		}
+		else if(use_pyramid(frame, info, picked, size))
+		{
+			gray_levels(frame, info, picked, next_pyr, scaled);
+			next_pyr[0] = next;
+			std::swap(prvs_pyr, next_pyr);
+		}
+		
+		cv::Size eff_size(std::max(1, (int)std::round(size.width * p.scale)), std::max(1, (int)std::round(size.height * p.scale)));
+		if(p.scale != 1.0)
+		{
+			cv::resize(next, next_eff, eff_size, 0, 0, cv::INTER_AREA);
+			if(prvs_eff.size() != eff_size)
+				cv::resize(prvs, prvs_eff, eff_size, 0, 0, cv::INTER_AREA);
+		}
+		else
+		{
+			next_eff = next;
+			prvs_eff = prvs;
+		}
+		
+		auto flow_start = std::chrono::steady_clock::now();
+		{
+			imgux::trace_span span("farneback");
+			cv::calcOpticalFlowFarneback(prvs_eff, next_eff, flow_eff, pyr_scale, p.levels, p.winsize, p.iterations, poly_n, poly_sigma, 0);// | cv::OPTFLOW_FARNEBACK_GAUSSIAN);
+			//cv::calcOpticalFlowSF(prvs, next, flow, 3, 2, 4, 4.1, 25.5, 18, 55.0, 25.5, 0.35, 18, 55.0, 25.5, 10); // super slow but accurate
+		}
+		auto flow_end = std::chrono::steady_clock::now();
+		
+		double velocity_scale = 15.0; // is this srsly 'cause of the FPS?
+		if(p.scale != 1.0)
+		{
+			cv::resize(flow_eff, flow, size);
+			velocity_scale /= p.scale; // vectors were measured in the smaller image's pixels
+		}
+		else
+			flow = flow_eff;
+		
+		cv::swap(prvs, next);
+		if(p.scale != 1.0)
+			cv::swap(prvs_eff, next_eff);
+		else
+			prvs_eff = cv::Mat();
 		
 		for(int y = 0; y < flow.rows; y++)
 		for(int x = 0; x < flow.cols; x++)
 		{
 			cv::Point2f& vec = flow.at<cv::Point2f>(y, x);
-			vec.x *= 15.0; // is this srsly 'cause of the FPS?
-			vec.y *= 15.0;
+			vec.x *= velocity_scale;
+			vec.y *= velocity_scale;
 		}
 		
-		do_stuff_with_flow(flow, next, info);
+		auto end = std::chrono::steady_clock::now();
+		controller.update(std::chrono::duration<double, std::milli>(flow_end - flow_start).count(), std::chrono::duration<double, std::milli>(end - start).count());
+		
+		do_stuff_with_flow(flow, prvs, info, *out, vis_out, cflow);
+		return true;
+	}
+	
+	void record_latency(std::chrono::steady_clock::time_point read_at)
+	{
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - read_at).count();
+		frames++;
+		latency_total += ms;
+		latency_max = std::max(latency_max, ms);
+	}
+};
+
+int main_cpu()
+{
+	flow_stream stream;
+	stream.name = "default";
+	stream.in = imgux::frame_default_reader();
+	stream.out = imgux::frame_default_writer();
+	stream.vis_out = default_visualize_output();
+	
+	std::string roi_input;
+	imgux::arguments_get("roi-input", roi_input);
+	if(roi_input != "")
+		stream.rois_in = new roi_feed(roi_input); // never freed, see roi_feed
+	
+	imgux::frame_info info;
+	
+	while (true)
+	{
+		if(!stream.in->read(stream.GetImg, info))
+			break;
+		stream.process(stream.GetImg, info);
+	}
+	
+	return 0;
+}
+
+// consecutive frame pairs are independent of each other (there's no warm start from the previous flow), so solve them
+// on many threads and put the results back in order before writing; the parameters are fixed, so this is deterministic
+int main_cpu_pairs(int threads)
+{
+	if(deadline_ms > 0)
+	{
+		std::cerr << "opticalflow: warning: --deadline-ms is ignored with --pair-threads, results would depend on timing\n";
+		deadline_ms = 0;
+	}
+	
+	struct result
+	{
+		cv::Mat flow, cflow;
+		imgux::frame_info info;
+	};
+	
+	imgux::writer& out = *imgux::frame_default_writer();
+	imgux::writer* vis_out = default_visualize_output();
+	
+	std::mutex lock;
+	std::condition_variable changed;
+	std::map<size_t, result> reorder;
+	size_t next_write = 0, in_flight = 0;
+	size_t max_in_flight = 0;
+	
+	cv::setNumThreads(1);
+	imgux::thread_pool pool(threads);
+	max_in_flight = pool.size() * 2;
+	std::cerr << "opticalflow: solving frame pairs on " << pool.size() << " threads\n";
+	
+	// with a pyramid source this solves the way flow_stream does, so --pair-threads doesn't change the flow
+	auto prepare = [](const cv::Mat& frame, imgux::frame_info& info, cv::Size size, std::vector<cv::Mat>& pyr)
+	{
+		int picked;
+		cv::Mat gray, scaled, base = flow_stream::pick_level(frame, info, size, picked);
+		
+		pyr.clear();
+		if(flow_stream::use_pyramid(frame, info, picked, size))
+			flow_stream::gray_levels(frame, info, picked, pyr, scaled);
+		
+		imgux::frameinfo_remove("pyramid-levels", info);
+		imgux::frameinfo_remove("pyramid-width", info);
+		imgux::frameinfo_remove("pyramid-height", info);
+		
+		if(!pyr.empty())
+			gray = pyr[0];
+		else
+			gray_at_size(base, info, size, gray, scaled);
+		return gray;
+	};
+	
+	cv::Mat GetImg;
+	imgux::frame_info info;
+	
+	if(!imgux::frame_read(GetImg, info))
+		return 0;
+	
+	cv::Size full = imgux::frame_image_size(imgux::frame_pyramid_level(GetImg, info, 0), info);
+	cv::Size size(full.width/s, full.height/s);
+	std::vector<cv::Mat> prvs_pyr, next_pyr;
+	cv::Mat prvs = prepare(GetImg, info, size, prvs_pyr);
+	
+	std::stringstream ss;
+	ss << std::fixed << ";flow-winsize=" << (double)winsize << ";flow-scale=" << 1.0
+		<< ";flow-levels=" << levels << ";flow-iterations=" << iterations << ";";
+	std::string frameinfo_ext = ss.str();
+	
+	for(size_t seq = 0; imgux::frame_read(GetImg, info); seq++)
+	{
+		bool unchanged = imgux::frame_repeated(info) or (imgux::frameinfo_has("damage", info) and imgux::frameinfo_rects("damage", info).empty());
+		cv::Mat next = prvs;
+		next_pyr = prvs_pyr;
+		if(!unchanged)
+			next = prepare(GetImg, info, size, next_pyr);
+		info.info += frameinfo_ext;
+		
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			changed.wait(lk, [&] { return in_flight < max_in_flight; });
+			in_flight++;
+		}
+		
+		pool.submit([&, seq, prvs, next, prvs_pyr, next_pyr, info, unchanged]
+		{
+			result r;
+			r.info = info;
+			if(imgux::trace_enabled())
+				imgux::trace_frame(imgux::frameinfo_frame(info));
+			
+			if(unchanged)
+				r.flow = cv::Mat::zeros(size, CV_32FC2);
+			else
+			{
+				imgux::trace_span span("farneback");
+				if(!prvs_pyr.empty() and !next_pyr.empty())
+					flow_stream::pyramid_flow(prvs_pyr, next_pyr, r.flow, levels, winsize, iterations);
+				else
+					cv::calcOpticalFlowFarneback(prvs, next, r.flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, 0);
+				r.flow.convertTo(r.flow, -1, 15.0);
+			}
+			compensate_global_motion(r.flow, r.info);
+			colourize_for_output(r.flow, next, r.cflow);
+			
+			std::lock_guard<std::mutex> lk(lock);
+			reorder[seq] = r;
+			
+			// whoever finishes the frame we're waiting on writes out everything that's now in order
+			while(!reorder.empty() and reorder.begin()->first == next_write)
+			{
+				result& ready = reorder.begin()->second;
+				write_flow(ready.flow, ready.cflow, ready.info, out, vis_out);
+				
+				reorder.erase(reorder.begin());
+				next_write++;
+				in_flight--;
+			}
+			changed.notify_all();
+		});
+		
+		prvs = next;
+		std::swap(prvs_pyr, next_pyr);
+	}
+	
+	std::unique_lock<std::mutex> lk(lock);
+	changed.wait(lk, [&] { return in_flight == 0; });
+	
+	return 0;
+}
+
+// many streams in one process: a reader thread per stream, and each stream's frames are handed to a shared
+// work-stealing pool one at a time, so every stream gets its turn no matter how fast the others produce frames
+int main_multi(const std::string& inputs, const std::string& outputs, int threads, double stats_interval)
+{
+	auto split = [](const std::string& list)
+	{
+		std::vector<std::string> ret;
+		std::stringstream ss(list);
+		std::string item;
+		while(std::getline(ss, item, ','))
+			ret.push_back(item);
+		return ret;
+	};
+	
+	std::vector<std::string> ins = split(inputs), outs = split(outputs);
+	if(ins.size() != outs.size())
+	{
+		std::cerr << "opticalflow: error: --inputs and --outputs must have the same number of entries\n";
+		return 1;
+	}
+	if(visualize and visualize_out == "")
+	{
+		std::cerr << "opticalflow: warning: can't show a window for multiple streams, use --visualize-out\n";
+		visualize = false;
+	}
+	
+	struct queued_frame
+	{
+		cv::Mat frame;
+		imgux::frame_info info;
+		std::chrono::steady_clock::time_point read_at;
+	};
+	
+	struct stream_state
+	{
+		flow_stream flow;
+		std::mutex lock;
+		std::condition_variable space;
+		std::deque<queued_frame> pending;
+		bool busy = false, finished = false;
+		std::thread reader;
+	};
+	
+	cv::setNumThreads(1); // the pool is our parallelism, don't oversubscribe the cores
+	
+	std::vector<std::unique_ptr<stream_state>> streams;
+	std::mutex done_lock;
+	std::condition_variable done_changed;
+	size_t done = 0;
+	
+	// declared before the pool, so the pool's workers are joined before it goes away
+	std::function<void(stream_state*)> step;
+	
+	imgux::thread_pool pool(threads);
+	std::cerr << "opticalflow: " << ins.size() << " streams on " << pool.size() << " threads\n";
+	
+	// process one frame of a stream, then queue the next one if it's waiting
+	step = [&](stream_state* st)
+	{
+		queued_frame qf;
+		{
+			std::lock_guard<std::mutex> lk(st->lock);
+			qf = std::move(st->pending.front());
+			st->pending.pop_front();
+		}
+		st->space.notify_one();
+		
+		if(imgux::trace_enabled()) // pool threads pick up any stream's frames
+			imgux::trace_frame(imgux::frameinfo_frame(qf.info));
+		bool wrote = st->flow.process(qf.frame, qf.info);
+		
+		bool finished;
+		{
+			std::lock_guard<std::mutex> lk(st->lock);
+			if(wrote)
+				st->flow.record_latency(qf.read_at);
+			st->busy = !st->pending.empty();
+			finished = st->finished and !st->busy;
+		}
+		
+		if(!finished and st->busy)
+			pool.submit([&step, st] { step(st); });
+		else if(finished)
+		{
+			std::lock_guard<std::mutex> lk(done_lock);
+			done++;
+			done_changed.notify_all();
+		}
+	};
+	
+	for(size_t i = 0; i < ins.size(); i++)
+	{
+		stream_state* st = new stream_state();
+		streams.emplace_back(st);
+		
+		st->flow.name = ins[i];
+		
+		// each stream opens its own ends, as a FIFO or socket waits for its peer and mustn't hold up the other streams
+		st->reader = std::thread([&, st, i]
+		{
+			st->flow.in = new imgux::reader(ins[i]);
+			st->flow.out = new imgux::writer(outs[i]);
+			if(visualize)
+			{
+				std::stringstream vs;
+				vs << visualize_out << "." << i;
+				st->flow.vis_out = new imgux::writer(vs.str());
+			}
+			
+			cv::Mat frame;
+			imgux::frame_info info;
+			
+			while(true)
+			{
+				bool ok = st->flow.in->read(frame, info);
+				
+				std::unique_lock<std::mutex> lk(st->lock);
+				if(!ok)
+				{
+					st->finished = true;
+					if(!st->busy)
+					{
+						std::lock_guard<std::mutex> dlk(done_lock);
+						done++;
+						done_changed.notify_all();
+					}
+					return;
+				}
+				
+				st->space.wait(lk, [st] { return st->pending.size() < 2; });
+				st->pending.push_back(queued_frame{frame.clone(), info, std::chrono::steady_clock::now()});
+				
+				if(!st->busy)
+				{
+					st->busy = true;
+					pool.submit([&step, st] { step(st); });
+				}
+			}
+		});
+	}
+	
+	auto report = [&]
+	{
+		for(auto& st : streams)
+		{
+			flow_stream& f = st->flow;
+			std::lock_guard<std::mutex> lk(st->lock);
+			std::cerr << "opticalflow: " << f.name << ": " << f.frames << " frames, latency avg "
+				<< (f.frames ? f.latency_total / f.frames : 0.0) << "ms max " << f.latency_max << "ms\n";
+		}
+	};
+	
+	{
+		std::unique_lock<std::mutex> lk(done_lock);
+		while(done < streams.size())
+		{
+			if(stats_interval > 0)
+			{
+				if(!done_changed.wait_for(lk, std::chrono::duration<double>(stats_interval), [&] { return done == streams.size(); }))
+				{
+					lk.unlock();
+					report();
+					lk.lock();
+				}
+			}
+			else
+				done_changed.wait(lk);
+		}
+	}
+	
+	report();
+	
+	for(auto& st : streams)
+	{
+		st->reader.join();
+		delete st->flow.in;
+		delete st->flow.out;
+		delete st->flow.vis_out;
 	}
 	
 	return 0;
@@ -264,9 +1159,22 @@ int main(int argc, char** argv)
 	imgux::arguments_add("colourize", "0", "0 = float_x, float_y (CV_32FC2); 1 = hue = byte_dir, sat = byte_speed, val = byte_speed (CV_8UC3|CV_BGR8);");
 	imgux::arguments_add("scale", "1.0", "Multiply size by this");
 	imgux::arguments_add("visualize", "0", "Visualize the flow?");
-	imgux::arguments_add("visualize-out", "", "File to write the visualized frame out. Empty for showing in a new window.");
+	imgux::arguments_add("visualize-out", "", "File(s) to write the visualized frame out, same format as --output. Empty for showing in a new window.");
 	imgux::arguments_add("velocity-fix", "1", "Should we multiply the velocity by the frame time?");
 	imgux::arguments_add("use-gpu", "auto", "auto|always|never");
+	imgux::arguments_add("inputs", "", "Comma separated inputs to process in one process (with matching --outputs), sharing a thread pool");
+	imgux::arguments_add("outputs", "", "Comma separated outputs for --inputs");
+	imgux::arguments_add("threads", "0", "Thread pool size for --inputs, 0 for one per core");
+	imgux::arguments_add("pair-threads", "1", "Solve this many consecutive frame pairs at once and reorder the results (0 for one per core); for recorded footage");
+	imgux::arguments_add("stats-interval", "10", "Seconds between per-stream latency reports for --inputs, 0 to only report at the end");
+	imgux::arguments_add("flow-format", "float", "float = interleaved CV_32FC2; int16 = planar fixed point (the x plane above the y plane), half the bandwidth");
+	imgux::arguments_add("flow-quant", "16", "Fixed point units per pixel for --flow-format=int16 (16 covers +-2048, the flow is scaled by 15)");
+	imgux::arguments_add("deadline-ms", "0", "Per frame time budget; scale, levels, iterations and winsize are lowered at runtime to fit it. 0 to always use the given parameters (CPU only)");
+	imgux::arguments_add("roi-input", "", "Regions of interest from flow-motiontrack --roi-output; only they get full quality flow, the rest a low resolution sweep (CPU only)");
+	imgux::arguments_add("roi-sweep-scale", "0.25", "Scale of the sweep over the rest of the frame with --roi-input");
+	imgux::arguments_add("roi-timeout", "1", "Seconds without a region update before going back to whole frames");
+	imgux::arguments_add("global-motion", "none", "Remove the camera's own motion from the flow: none|translation (median)|affine (RANSAC, also zoom and roll)");
+	imgux::arguments_add("global-motion-step", "8", "Sample every this many pixels of the flow to estimate the global motion");
 	
 	imgux::arguments_parse(argc, argv);
 	
@@ -282,13 +1190,48 @@ int main(int argc, char** argv)
 	imgux::arguments_get("scale", s);
 	imgux::arguments_get("visualize", visualize);
 	imgux::arguments_get("visualize-out", visualize_out);
+	imgux::arguments_get("deadline-ms", deadline_ms);
+	imgux::arguments_get("roi-sweep-scale", roi_sweep);
+	imgux::arguments_get("roi-timeout", roi_timeout);
+	imgux::arguments_get("global-motion", global_motion);
+	imgux::arguments_get("global-motion-step", global_motion_step);
+	if(global_motion != "none" and global_motion != "translation" and global_motion != "affine")
+	{
+		std::cerr << "opticalflow: error: --global-motion must be none, translation or affine\n";
+		return 1;
+	}
 	s = 1.0/s;
+	
+	std::string flow_format;
+	imgux::arguments_get("flow-format", flow_format);
+	imgux::arguments_get("flow-quant", flow_quant);
+	if(flow_format != "float" and flow_format != "int16")
+	{
+		std::cerr << "opticalflow: error: --flow-format must be either float or int16\n";
+		return 1;
+	}
+	flow_fixed = flow_format == "int16";
 
-	if(visualize)
+	std::string inputs, outputs;
+	int threads, pair_threads;
+	double stats_interval;
+	imgux::arguments_get("inputs", inputs);
+	imgux::arguments_get("outputs", outputs);
+	imgux::arguments_get("threads", threads);
+	imgux::arguments_get("pair-threads", pair_threads);
+	imgux::arguments_get("stats-interval", stats_interval);
+	
+	if(inputs != "")
+		return main_multi(inputs, outputs, threads, stats_interval);
+	
+	if(visualize and visualize_out == "")
 		cv::namedWindow("Optical Flow");
 	
 	imgux::frame_setup();
 	
+	if(pair_threads != 1)
+		return main_cpu_pairs(pair_threads);
+	
 	std::string gpu;
 	imgux::arguments_get("use-gpu", gpu);
 	
@@ -0,0 +1,143 @@
+#ifndef pool_HPP
+#define pool_HPP
+
+// STL
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+namespace imgux
+{
+	// a work-stealing thread pool: each worker runs its own queue oldest first, and when that's empty takes the
+	// newest task from someone else's, so one busy queue can't leave the other cores idle
+	class thread_pool
+	{
+	public:
+		typedef std::function<void()> task;
+		
+		thread_pool(size_t threads = 0)
+		{
+			if(threads == 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+			
+			for(size_t i = 0; i < threads; i++)
+				queues.emplace_back(new worker_queue());
+			
+			for(size_t i = 0; i < threads; i++)
+				workers.emplace_back([this, i] { this->run(i); });
+		}
+		
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lk(sleep_lock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for(std::thread& worker : workers)
+				worker.join();
+		}
+		
+		size_t size() const
+		{
+			return workers.size();
+		}
+		
+		// tasks submitted from a worker stay on that worker (its caches are warm), others are spread round robin
+		void submit(task t)
+		{
+			size_t index = current_worker() < queues.size() ? current_worker() : next_queue++ % queues.size();
+			{
+				std::lock_guard<std::mutex> lk(queues[index]->lock);
+				queues[index]->tasks.push_back(std::move(t));
+			}
+			{
+				std::lock_guard<std::mutex> lk(sleep_lock);
+				queued++;
+			}
+			wake.notify_one();
+		}
+	
+	private:
+		struct worker_queue
+		{
+			std::mutex lock;
+			std::deque<task> tasks;
+		};
+		
+		std::vector<std::unique_ptr<worker_queue>> queues;
+		std::vector<std::thread> workers;
+		std::atomic<size_t> next_queue{0};
+		
+		std::mutex sleep_lock;
+		std::condition_variable wake;
+		size_t queued = 0;
+		bool stopping = false;
+		
+		static size_t& current_worker()
+		{
+			static thread_local size_t index = (size_t)-1;
+			return index;
+		}
+		
+		bool take(size_t index, task& t)
+		{
+			{
+				worker_queue& own = *queues[index];
+				std::lock_guard<std::mutex> lk(own.lock);
+				if(!own.tasks.empty())
+				{
+					t = std::move(own.tasks.front());
+					own.tasks.pop_front();
+					return true;
+				}
+			}
+			
+			for(size_t n = 1; n < queues.size(); n++)
+			{
+				worker_queue& other = *queues[(index + n) % queues.size()];
+				std::lock_guard<std::mutex> lk(other.lock);
+				if(!other.tasks.empty())
+				{
+					t = std::move(other.tasks.back());
+					other.tasks.pop_back();
+					return true;
+				}
+			}
+			
+			return false;
+		}
+		
+		void run(size_t index)
+		{
+			current_worker() = index;
+			task t;
+			
+			while(true)
+			{
+				{
+					std::unique_lock<std::mutex> lk(sleep_lock);
+					wake.wait(lk, [this] { return this->stopping or this->queued > 0; });
+					if(queued == 0) // stopping and nothing left
+						return;
+					queued--;
+				}
+				
+				// a task is reserved for us, keep looking until we find it (another worker may be mid-push)
+				while(!take(index, t))
+					std::this_thread::yield();
+				
+				t();
+				t = nullptr;
+			}
+		}
+	};
+}
+
+#endif
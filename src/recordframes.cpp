@@ -4,30 +4,453 @@
 #include <string>
 #include <sstream>
 #include <regex>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <iomanip>
 
 #include <opencv2/highgui/highgui.hpp>
 
+#include "avi.hpp"
+
+// encodes frames on background threads, so the passthrough never has to wait for the encoder
+// with one thread frames go through cv::VideoWriter, with more each worker JPEG-compresses whole frames
+// (MJPG is intra-only) and the results are muxed back into order; JPEG streams are muxed as they are, never re-encoded
+struct async_encoder
+{
+	enum policy_t
+	{
+		block, // wait for the encoder to catch up
+		drop   // discard the frame if the queue is full
+	};
+	
+	policy_t policy;
+	size_t max_queue;
+	size_t dropped = 0;
+	int quality;
+	imgux::frame_info layout; // only the pixel format is used, luma/yuv streams are converted on the workers
+	bool serial;
+	bool opened;
+	
+	// serial
+	cv::VideoWriter writer;
+	
+	// parallel
+	imgux::avi_writer avi;
+	std::map<size_t, std::vector<uchar>> reorder;
+	size_t next_write = 0;
+	std::mutex mux_lock;
+	
+	std::deque<std::pair<size_t, cv::Mat>> queue;
+	size_t next_seq = 0;
+	std::mutex lock;
+	std::condition_variable changed;
+	bool closing = false;
+	std::vector<std::thread> workers;
+	
+	async_encoder(const std::string& file, double fps, cv::Size size, policy_t policy, size_t max_queue, int threads, int quality,
+		imgux::pixel_format format = imgux::pixel_format::mat) :
+		policy(policy), max_queue(max_queue), quality(quality)
+	{
+		layout.format = format;
+		serial = threads <= 1 and format != imgux::pixel_format::jpeg;
+		
+		if(serial)
+			opened = writer.open(file, CV_FOURCC('M','J','P','G'), fps, size, true);
+		else
+			opened = avi.open(file, size.width, size.height, fps);
+		if(!opened)
+			std::cerr << "recordframes: error: can't open " << file << " for writing\n";
+		
+		// remuxing is just a copy, a second thread would only contend for the mux lock
+		if(format == imgux::pixel_format::jpeg)
+			threads = 1;
+		
+		for(int i = 0; i < std::max(threads, 1); i++)
+			workers.emplace_back([this]
+			{
+				std::pair<size_t, cv::Mat> item;
+				cv::Mat scratch;
+				std::vector<uchar> jpeg;
+				std::vector<int> params = {CV_IMWRITE_JPEG_QUALITY, this->quality};
+				
+				while(true)
+				{
+					{
+						std::unique_lock<std::mutex> lk(this->lock);
+						this->changed.wait(lk, [this] { return this->closing or !this->queue.empty(); });
+						
+						if(this->queue.empty()) // closing and drained
+							return;
+						
+						item = this->queue.front();
+						this->queue.pop_front();
+					}
+					this->changed.notify_all();
+					
+					if(this->layout.format == imgux::pixel_format::jpeg)
+					{
+						imgux::trace_span span("remux");
+						jpeg.assign(item.second.ptr(), item.second.ptr() + item.second.total());
+					}
+					else
+					{
+						imgux::trace_span span("encode");
+						cv::Mat bgr = imgux::frame_as_bgr(item.second, this->layout, scratch);
+						
+						if(this->serial)
+						{
+							this->writer.write(bgr);
+							continue;
+						}
+						
+						cv::imencode(".jpg", bgr, jpeg, params);
+					}
+					
+					std::lock_guard<std::mutex> lk(this->mux_lock);
+					this->reorder[item.first].swap(jpeg);
+					
+					while(!this->reorder.empty() and this->reorder.begin()->first == this->next_write)
+					{
+						this->avi.write(this->reorder.begin()->second);
+						this->reorder.erase(this->reorder.begin());
+						this->next_write++;
+					}
+				}
+			});
+	}
+	
+	// only called from one thread, so the queue can't fill up between checking and pushing
+	void push(const cv::Mat& frame, bool copy = true)
+	{
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			
+			if(queue.size() >= max_queue)
+			{
+				if(policy == drop)
+				{
+					dropped++;
+					return;
+				}
+				changed.wait(lk, [this] { return this->queue.size() < this->max_queue; });
+			}
+		}
+		
+		cv::Mat owned = copy ? frame.clone() : frame;
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			queue.emplace_back(next_seq++, owned);
+		}
+		changed.notify_all();
+	}
+	
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lk(lock);
+			closing = true;
+		}
+		changed.notify_all();
+		for(std::thread& worker : workers)
+			worker.join();
+		workers.clear();
+		
+		writer.release();
+		avi.close();
+	}
+};
+
+// only records while the trigger key in the frame info says something is happening
+// frames are held in a pre-roll ring while idle, and each event is written to its own segment file
+struct triggered_recorder
+{
+	std::string trigger, file;
+	double fps;
+	cv::Size size;
+	imgux::pixel_format format;
+	async_encoder::policy_t policy;
+	size_t max_queue;
+	int threads, quality;
+	size_t postroll_frames;
+	
+	std::vector<cv::Mat> ring;
+	size_t ring_start = 0, ring_count = 0;
+	
+	std::unique_ptr<async_encoder> current;
+	
+	struct closing_segment
+	{
+		std::thread thread;
+		std::shared_ptr<std::atomic<bool>> done;
+	};
+	std::vector<closing_segment> finishing;
+	size_t idle_for = 0;
+	size_t segments = 0;
+	std::atomic<size_t> dropped;
+	
+	triggered_recorder(const std::string& trigger, const std::string& file, double fps, cv::Size size, imgux::pixel_format format,
+		async_encoder::policy_t policy, size_t max_queue, int threads, int quality, double preroll, double postroll) :
+		trigger(trigger), file(file), fps(fps), size(size), format(format), policy(policy), max_queue(max_queue), threads(threads), quality(quality), dropped(0)
+	{
+		ring.resize(std::max(1, (int)std::round(preroll * fps)));
+		postroll_frames = std::round(postroll * fps);
+	}
+	
+	bool is_active(const imgux::frame_info& info)
+	{
+		return imgux::frameinfo_number(trigger, info) > 0 or !imgux::frameinfo_rects(trigger, info).empty();
+	}
+	
+	std::string segment_name(size_t n)
+	{
+		std::stringstream ss;
+		size_t dot = file.rfind('.');
+		ss << file.substr(0, dot) << "-" << std::setw(4) << std::setfill('0') << n;
+		if(dot != std::string::npos)
+			ss << file.substr(dot);
+		return ss.str();
+	}
+	
+	void add(const cv::Mat& frame, const imgux::frame_info& info)
+	{
+		bool active = is_active(info);
+		
+		if(!current and active)
+		{
+			std::string name = segment_name(++segments);
+			std::cerr << "recordframes: activity started, recording " << name << "\n";
+			
+			current.reset(new async_encoder(name, fps, size, policy, std::max(max_queue, ring.size() + 1), threads, quality, format));
+			if(!current->opened) // keep passing frames through, the next event may have better luck
+			{
+				current->close();
+				current.reset();
+				return;
+			}
+			
+			// hand the ring's buffers over to the encoder, and give the ring fresh ones
+			for(size_t i = 0; i < ring_count; i++)
+			{
+				cv::Mat& slot = ring[(ring_start + i) % ring.size()];
+				current->push(slot, false);
+				slot = cv::Mat();
+			}
+			ring_start = ring_count = 0;
+		}
+		
+		if(!current)
+		{
+			size_t pos = (ring_start + ring_count) % ring.size();
+			if(ring_count == ring.size())
+				ring_start = (ring_start + 1) % ring.size();
+			else
+				ring_count++;
+			
+			frame.copyTo(ring[pos]); // reuses the slot's buffer
+			return;
+		}
+		
+		current->push(frame);
+		idle_for = active ? 0 : idle_for + 1;
+		
+		if(idle_for > postroll_frames)
+		{
+			std::cerr << "recordframes: activity ended\n";
+			finish();
+		}
+	}
+	
+	// closing waits for the encoder to drain, so don't do it on the passthrough thread
+	void finish()
+	{
+		if(!current)
+			return;
+		
+		// the segments that have finished closing are joined here, so a long running recorder doesn't collect threads
+		for(auto it = finishing.begin(); it != finishing.end();)
+		{
+			if(*it->done)
+			{
+				it->thread.join();
+				it = finishing.erase(it);
+			}
+			else
+				++it;
+		}
+		
+		async_encoder* encoder = current.release();
+		std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+		finishing.push_back(closing_segment{std::thread([this, encoder, done]
+		{
+			encoder->close();
+			this->dropped += encoder->dropped;
+			delete encoder;
+			*done = true;
+		}), done});
+		idle_for = 0;
+	}
+	
+	void close()
+	{
+		finish();
+		for(closing_segment& segment : finishing)
+			segment.thread.join();
+		finishing.clear();
+	}
+};
+
+// encode synthetic frames serially and in parallel, to see how well the parallel encoder scales on this machine
+int benchmark(const std::string& file, int frames, cv::Size size, int threads, int quality)
+{
+	std::vector<cv::Mat> source(8);
+	for(cv::Mat& frame : source)
+	{
+		frame.create(size, CV_8UC3);
+		cv::randu(frame, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+		cv::blur(frame, frame, cv::Size(9, 9)); // pure noise is unrealistically hard to compress
+	}
+	
+	std::vector<int> counts = {1};
+	for(int n = 2; n < threads; n *= 2)
+		counts.push_back(n);
+	if(threads > 1)
+		counts.push_back(threads);
+	
+	double serial = 0;
+	for(int count : counts)
+	{
+		auto start = std::chrono::steady_clock::now();
+		
+		async_encoder encoder(file, 30, size, async_encoder::block, count * 2, count, quality);
+		for(int i = 0; i < frames; i++)
+			encoder.push(source[i % source.size()], false);
+		encoder.close();
+		
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double fps = frames / secs;
+		if(count == 1)
+			serial = fps;
+		
+		std::cerr << "recordframes: benchmark: " << count << " thread(s): " << fps << " fps (" << fps / serial << "x)\n";
+	}
+	
+	return 0;
+}
+
+// frames from videosource --replay carry the wall clock time they left it, so the end of a pipeline can report
+// how long frames took to get here and how many arrived per second
+struct latency_report
+{
+	size_t frames = 0;
+	double total = 0, max = 0;
+	double first = 0, last = 0;
+	
+	void add(const imgux::frame_info& info)
+	{
+		double wall = imgux::frameinfo_number("wall", info);
+		if(wall <= 0)
+			return;
+		
+		double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+		double ms = (now - wall) * 1000.0;
+		
+		if(frames++ == 0)
+			first = now;
+		last = now;
+		total += ms;
+		max = std::max(max, ms);
+	}
+	
+	void print(const std::string& file)
+	{
+		if(frames == 0)
+			return;
+		double span = last - first;
+		std::cerr << std::fixed << "recordframes: " << frames << " frames, " << (span > 0 ? (frames - 1) / span : 0.0)
+			<< " fps, end-to-end latency avg " << total / frames << "ms max " << max << "ms (" << file << ")\n";
+	}
+};
+
 int main(int argc, char** argv)
 {
 	imgux::arguments_add("file", "recording.avi", "The file to output to");
+	imgux::arguments_add("queue", "30", "How many frames may wait for the encoder");
+	imgux::arguments_add("policy", "drop", "What to do when the encoder queue is full: drop|block");
+	imgux::arguments_add("threads", "1", "Encoder threads; 1 uses cv::VideoWriter, more JPEG-compresses frames in parallel, 0 for one per core");
+	imgux::arguments_add("quality", "95", "JPEG quality for the parallel encoder");
+	imgux::arguments_add("trigger", "", "Only record while this frame info key is non-zero or a non-empty rect list (e.g. tracked from flow-motiontrack, or damage); empty records everything");
+	imgux::arguments_add("preroll", "2", "Seconds of frames to keep before activity starts, with --trigger");
+	imgux::arguments_add("postroll", "5", "Seconds to keep recording after activity ends, with --trigger");
+	imgux::arguments_add("benchmark", "0", "Encode this many synthetic frames at each thread count to --file and report the speed");
+	imgux::arguments_add("benchmark-size", "1920x1080", "Frame size for --benchmark");
 	imgux::arguments_parse(argc, argv);
 	
-	std::string	file;
+	std::string	file, policy_str, bench_size, trigger;
+	int max_queue, threads, quality, bench_frames;
+	double preroll_secs, postroll_secs;
 	imgux::arguments_get("file", file);
+	imgux::arguments_get("queue", max_queue);
+	imgux::arguments_get("policy", policy_str);
+	imgux::arguments_get("threads", threads);
+	imgux::arguments_get("quality", quality);
+	imgux::arguments_get("trigger", trigger);
+	imgux::arguments_get("preroll", preroll_secs);
+	imgux::arguments_get("postroll", postroll_secs);
+	imgux::arguments_get("benchmark", bench_frames);
+	imgux::arguments_get("benchmark-size", bench_size);
+	
+	if(threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	
+	if(bench_frames > 0)
+	{
+		cv::Size size;
+		char x;
+		std::stringstream ss(bench_size);
+		ss >> size.width >> x >> size.height;
+		
+		return benchmark(file, bench_frames, size, std::max(threads, (int)std::thread::hardware_concurrency()), quality);
+	}
+	
+	async_encoder::policy_t policy;
+	if(policy_str == "drop")
+		policy = async_encoder::drop;
+	else if(policy_str == "block")
+		policy = async_encoder::block;
+	else
+	{
+		std::cerr << "recordframes: error: --policy must be either drop or block\n";
+		return 1;
+	}
 	
-	imgux::frame_setup();	
+	imgux::frame_setup();
 	cv::Mat mat;
 	imgux::frame_info info;
+	latency_report latency;
 	
-	// measure the FPS
+	// measure the FPS, keeping the frames so the recording still starts at the first one
+	std::vector<std::pair<cv::Mat, imgux::frame_info>> preroll;
 	double deltas = 0;
 	double deltas_count = 0;
+	bool finished = false;
 	
 	double t = -1;
 	for(int i = 0; i <= 10; i++)
 	{
 		if(!imgux::frame_read(mat, info))
-			return 1;
+		{
+			finished = true;
+			break;
+		}
+		latency.add(info);
+		imgux::frame_write(mat, info);
+		preroll.emplace_back(mat.clone(), info);
 		
 		double tnow = imgux::frameinfo_time(info);
 		
@@ -40,20 +463,69 @@ int main(int argc, char** argv)
 		t = tnow;
 	}
 	
-	deltas /= deltas_count;
-	int fps = std::round(1.0 / deltas);
+	if(preroll.empty())
+		return 1;
+	
+	int fps = 15;
+	if(deltas_count > 0 and deltas > 0)
+		fps = std::round(1.0 / (deltas / deltas_count));
 	
-	std::cerr << "recordframes: fps = " << fps << " (" << file << ")\n";
+	std::cerr << "recordframes: fps = " << fps << ", threads = " << threads << " (" << file << ")\n";
 	
-	cv::VideoWriter ov(file, CV_FOURCC('M','J','P','G'), fps, mat.size(), true);
+	cv::Size size = imgux::frame_image_size(preroll[0].first, preroll[0].second);
+	imgux::pixel_format format = preroll[0].second.format;
+	size_t dropped = 0;
 	
-	while(true)
+	if(trigger != "")
 	{
-		if(!imgux::frame_read(mat, info))
-			break;
-		imgux::frame_write(mat, info);
-		ov.write(mat);
+		triggered_recorder recorder(trigger, file, fps, size, format, policy, max_queue, threads, quality, preroll_secs, postroll_secs);
+		
+		for(const auto& frame : preroll)
+			recorder.add(frame.first, frame.second);
+		preroll.clear();
+		
+		while(!finished)
+		{
+			if(!imgux::frame_read(mat, info))
+				break;
+			latency.add(info);
+			imgux::frame_write(mat, info);
+			recorder.add(mat, info);
+		}
+		
+		recorder.close();
+		dropped = recorder.dropped;
+		std::cerr << "recordframes: recorded " << recorder.segments << " segments (" << file << ")\n";
 	}
+	else
+	{
+		async_encoder encoder(file, fps, size, policy, std::max(max_queue, (int)preroll.size()), threads, quality, format);
+		if(!encoder.opened)
+		{
+			encoder.close();
+			return 1;
+		}
+		
+		for(const auto& frame : preroll)
+			encoder.push(frame.first, false);
+		preroll.clear();
+		
+		while(!finished)
+		{
+			if(!imgux::frame_read(mat, info))
+				break;
+			latency.add(info);
+			imgux::frame_write(mat, info);
+			encoder.push(mat);
+		}
+		
+		encoder.close();
+		dropped = encoder.dropped;
+	}
+	
+	if(dropped > 0)
+		std::cerr << "recordframes: dropped " << dropped << " frames (" << file << ")\n";
+	latency.print(file);
 	
 	return 0;
 }
@@ -3,6 +3,10 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #include <opencv2/highgui/highgui.hpp>
 
@@ -10,19 +14,72 @@ int main(int argc, char** argv)
 {
 	imgux::arguments_add("title", "frame", "Default title");
 	imgux::arguments_add("write-frame", "1", "Write the frame back out?");
+	imgux::arguments_add("max-fps", "30", "Redraw the window at most this often; frames in between are skipped");
+	imgux::arguments_add("display-scale", "1", "Scale the displayed frame (the written frame is unchanged)");
 	imgux::arguments_parse(argc, argv);
 	
 	std::string	title;
 	bool write_frame;
+	double max_fps, display_scale;
 	imgux::arguments_get("title", title);
 	imgux::arguments_get("write-frame", write_frame);
+	imgux::arguments_get("max-fps", max_fps);
+	imgux::arguments_get("display-scale", display_scale);
 	
 	imgux::frame_setup();
-	cv::namedWindow(title, cv::WINDOW_AUTOSIZE);
 	
 	std::cerr << "creating window " << title << "\n";
 	
-	cv::Mat mat;
+	// the display thread asks for a frame when it's ready to draw one, so we only copy frames that will be shown
+	cv::Mat latest;
+	bool wanted = false, fresh = false, running = true;
+	std::mutex lock;
+	std::condition_variable changed;
+	
+	std::thread t_display([&]
+	{
+		cv::namedWindow(title, cv::WINDOW_AUTOSIZE);
+		
+		auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / max_fps));
+		auto next = std::chrono::steady_clock::now();
+		cv::Mat shown, scaled;
+		
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lk(lock);
+				wanted = true;
+				changed.wait(lk, [&] { return fresh or !running; });
+				
+				if(!fresh)
+					break;
+				
+				cv::swap(shown, latest);
+				fresh = false;
+			}
+			
+			imgux::trace_span span("imshow");
+			if(display_scale != 1.0)
+			{
+				cv::resize(shown, scaled, cv::Size(), display_scale, display_scale, cv::INTER_AREA);
+				cv::imshow(title, scaled);
+			}
+			else
+				cv::imshow(title, shown);
+			
+			span.end();
+			
+			// keep the window responsive while we wait for the next redraw
+			next += interval;
+			auto now = std::chrono::steady_clock::now();
+			if(next < now)
+				next = now;
+			int wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+			cv::waitKey(std::max(wait, 1));
+		}
+	});
+	
+	cv::Mat mat, bgr;
 	imgux::frame_info info;
 	
 	while(true)
@@ -30,14 +87,28 @@ int main(int argc, char** argv)
 		if(!imgux::frame_read(mat, info))
 			break;
 		
-		cv::imshow(title, mat);
-		cv::waitKey(1);
-		
 		if(write_frame)
 		{
 			imgux::frame_write(mat, info);
 		}
+		
+		std::unique_lock<std::mutex> lk(lock, std::try_to_lock); // never wait on the window
+		if(lk.owns_lock() and wanted)
+		{
+			imgux::frame_as_bgr(mat, info, bgr).copyTo(latest); // luma/yuv streams are only converted for drawing
+			wanted = false;
+			fresh = true;
+			lk.unlock();
+			changed.notify_one();
+		}
+	}
+	
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		running = false;
 	}
+	changed.notify_one();
+	t_display.join();
 	
 	return 0;
 }
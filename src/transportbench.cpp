@@ -0,0 +1,108 @@
+#include <imgux.hpp>
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+// sends synthetic frames between two threads through each kind of --input/--output endpoint, to compare what the
+// transports cost: a FIFO (what the pipelines use by default), a unix socket, and TCP over loopback
+// every endpoint is written the same way in each pass: directly (one output, no policy), or through a fan-out sink
+// (what a policy or a list of outputs gets, which copies each frame into a record and writes it from another thread)
+int main(int argc, char** argv)
+{
+	imgux::arguments_add("endpoints", "fifo,unix:/tmp/imgux-bench.sock,tcp://127.0.0.1:47000", "Comma separated endpoints to test; fifo makes a temporary one");
+	imgux::arguments_add("frames", "1000", "Frames to send through each endpoint");
+	imgux::arguments_add("size", "1920x1080", "Frame size (8-bit, 3 channels)");
+	imgux::arguments_add("sinks", "direct,fanout", "Comma separated ways to write each endpoint: direct and/or fanout");
+	imgux::arguments_parse(argc, argv);
+	
+	std::string endpoints, size_str, sinks;
+	int frames;
+	imgux::arguments_get("endpoints", endpoints);
+	imgux::arguments_get("sinks", sinks);
+	imgux::arguments_get("frames", frames);
+	imgux::arguments_get("size", size_str);
+	
+	cv::Size size;
+	char x;
+	std::stringstream(size_str) >> size.width >> x >> size.height;
+	
+	cv::Mat frame(size, CV_8UC3);
+	cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+	double megabytes = frame.total() * frame.elemSize() / (1024.0 * 1024.0);
+	
+	std::stringstream sink_list(sinks);
+	std::string sink;
+	while(std::getline(sink_list, sink, ','))
+	{
+		if(sink != "direct" and sink != "fanout")
+		{
+			std::cerr << "transportbench: error: --sinks can only have direct and fanout\n";
+			return 1;
+		}
+		
+		std::stringstream ss(endpoints);
+		std::string endpoint;
+		while(std::getline(ss, endpoint, ','))
+		{
+			std::string spec = endpoint;
+			if(endpoint == "fifo")
+			{
+				spec = "/tmp/imgux-bench." + std::to_string(getpid()) + ".fifo";
+				if(mkfifo(spec.c_str(), 0600) != 0)
+				{
+					std::cerr << "transportbench: error: can't make " << spec << "\n";
+					continue;
+				}
+			}
+			
+			// timed from the first frame received, so waiting for the sender to connect isn't counted
+			int received = 0;
+			std::chrono::steady_clock::time_point first, last;
+			std::thread t_read([&]
+			{
+				imgux::reader in(spec);
+				cv::Mat mat;
+				imgux::frame_info info;
+				while(in.read(mat, info))
+				{
+					last = std::chrono::steady_clock::now();
+					if(received++ == 0)
+						first = last;
+				}
+			});
+			
+			{
+				imgux::writer out(sink == "fanout" ? spec + ":block" : spec);
+				for(int n = 0; n < frames; n++)
+				{
+					imgux::frame_info info;
+					info.info = "frame=" + std::to_string(n);
+					if(!out.write(frame, info))
+						break;
+				}
+			}
+			t_read.join();
+			
+			if(endpoint == "fifo")
+				unlink(spec.c_str());
+			
+			double seconds = std::chrono::duration<double>(last - first).count();
+			if(received < 2 or seconds <= 0)
+			{
+				std::cerr << "transportbench: " << endpoint << " (" << sink << "): only " << received << " of " << frames << " frames arrived\n";
+				continue;
+			}
+			
+			double fps = (received - 1) / seconds;
+			std::cerr << "transportbench: " << endpoint << " (" << sink << "): " << received << " of " << frames << " frames, " << fps << " fps, " << fps * megabytes << " MiB/s\n";
+		}
+	}
+	
+	return 0;
+}
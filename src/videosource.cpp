@@ -5,6 +5,8 @@
 #include <sstream>
 #include <chrono>
 #include <ctime>
+#include <thread>
+#include <algorithm>
 
 double time()
 {
@@ -41,13 +43,39 @@ int main(int argc, char** argv)
 {
 	imgux::arguments_add("rotate", "0", "Apply some rotation (90,180,270)");
 	imgux::arguments_add("scale", "1", "Scale the image");
+	imgux::arguments_add("pyramid", "1", "Emit this many pyramid levels (each half the size of the last) packed into each frame");
+	imgux::arguments_add("format", "bgr", "Pixel format to emit: bgr|gray|nv12|i420|jpeg (gray is the Y plane; pyramids are bgr or gray only)");
+	imgux::arguments_add("jpeg-quality", "90", "JPEG quality (0..100) for --format=jpeg");
+	imgux::arguments_add("replay", "0", "Stamp time= from the file's own frame timestamps rather than the clock, and report throughput at the end");
+	imgux::arguments_add("speed", "0", "With --replay, pace frames at this multiple of real time, 0 for as fast as the pipeline will take them");
 	imgux::arguments_parse(argc, argv);
 	std::vector<std::string> args = imgux::arguments_get_list();
 	
-	int rotate = 0;
-	double scale = 0;
+	int rotate = 0, pyramid = 1, jpeg_quality = 90;
+	double scale = 0, speed = 0;
+	bool replay = false;
 	imgux::arguments_get("rotate", rotate);
 	imgux::arguments_get("scale", scale);
+	imgux::arguments_get("pyramid", pyramid);
+	imgux::arguments_get("replay", replay);
+	imgux::arguments_get("speed", speed);
+	imgux::arguments_get("jpeg-quality", jpeg_quality);
+	
+	std::string format_name;
+	imgux::pixel_format format;
+	imgux::arguments_get("format", format_name);
+	if(!imgux::pixel_format_parse(format_name, format))
+	{
+		std::cerr << "videosource: error: unknown --format " << format_name << "\n";
+		return 1;
+	}
+	bool yuv = format == imgux::pixel_format::nv12 or format == imgux::pixel_format::i420;
+	bool jpeg = format == imgux::pixel_format::jpeg;
+	if((yuv or jpeg) and pyramid > 1)
+	{
+		std::cerr << "videosource: error: pyramids can only be bgr or gray\n";
+		return 1;
+	}
 	
 	if(args.size() < 2)
 	{
@@ -69,7 +97,9 @@ int main(int argc, char** argv)
 	}
 	
 	cv::VideoCapture stream = index >= 0 ? cv::VideoCapture(index) : cv::VideoCapture(file);
-	cv::Mat frame, frame_out;
+	cv::Mat frame, frame_out, frame_rot, frame_gray, frame_yuv;
+	std::vector<uchar> jpeg_data;
+	std::vector<int> jpeg_params = {CV_IMWRITE_JPEG_QUALITY, jpeg_quality};
 	
 	if(!(stream.read(frame))) //get one frame form video
 	{
@@ -81,25 +111,126 @@ int main(int argc, char** argv)
 	imgux::frame_setup();
 	
 	cv::Size targsize = cv::Size((double)frame.size().width * scale, (double)frame.size().height * scale);
+	if(yuv) // chroma is subsampled 2x2
+		targsize = cv::Size(targsize.width & ~1, targsize.height & ~1);
 	
 	size_t i = 0;
 	
+	// replaying: time comes from the container, so downstream results don't depend on how fast we ran
+	// falls back to counting frames at the fps from the last good position if the backend's positions stop going forwards
+	double source_fps = stream.get(CV_CAP_PROP_FPS);
+	if(!(source_fps > 0 and source_fps < 1000))
+		source_fps = 30;
+	double first_pos = -1, last_pos = -1, last_good = 0;
+	size_t last_good_frame = 0;
+	bool positions_ok = true;
+	
+	auto source_time = [&]()
+	{
+		double pos = stream.get(CV_CAP_PROP_POS_MSEC) / 1000.0;
+		if(first_pos < 0)
+			first_pos = pos;
+		if(i > 0 and pos <= last_pos)
+			positions_ok = false;
+		last_pos = pos;
+		
+		if(positions_ok)
+		{
+			last_good = pos - first_pos;
+			last_good_frame = i;
+			return last_good;
+		}
+		return last_good + (double)(i - last_good_frame) / source_fps;
+	};
+	
+	auto started = std::chrono::steady_clock::now();
+	double write_total = 0, write_max = 0; // time spent waiting on the pipeline to take a frame
+	double last_t = 0;
+	
 	while(true)
 	{
-		double t = time();
+		double t = replay ? source_time() : time();
+		last_t = t;
+		
+		if(replay and speed > 0)
+			std::this_thread::sleep_until(started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(t / speed)));
+		
 		std::stringstream ss;
 		ss << std::fixed << "time=" << t << ";frame=" << i++ << ";source=" << file;
+		if(replay) // only for measuring latency downstream, nothing may depend on it
+			ss << ";wall=" << std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
 		
 		imgux::frame_info info;
 		info.info = ss.str();
+		info.format = format;
 		
-		cv::resize(frame, frame_out, targsize);
+		imgux::trace_frame(i - 1);
+		imgux::trace_span span("cvtColor");
 		
-		if(rotate != 0)
-			rotate_image_90n(frame_out, frame_out, rotate);
+		// drop the colour before scaling, so there's a third as much to resize
+		const cv::Mat* source = &frame;
+		if(format == imgux::pixel_format::gray)
+		{
+			cv::cvtColor(frame, frame_gray, CV_BGR2GRAY);
+			source = &frame_gray;
+		}
+		
+		span.next("resize");
+		if(pyramid > 1 and rotate == 0)
+			imgux::frame_pyramid_build(*source, targsize, pyramid, frame_out, info); // scales straight into level 0
+		else if(pyramid > 1)
+		{
+			cv::resize(*source, frame_rot, targsize);
+			rotate_image_90n(frame_rot, frame_rot, rotate);
+			imgux::frame_pyramid_build(frame_rot, frame_rot.size(), pyramid, frame_out, info);
+		}
+		else
+		{
+			cv::resize(*source, frame_out, targsize);
+			
+			if(rotate != 0)
+				rotate_image_90n(frame_out, frame_out, rotate);
+		}
+		
+		span.next("cvtColor");
+		if(format == imgux::pixel_format::i420)
+			cv::cvtColor(frame_out, frame_yuv, CV_BGR2YUV_I420);
+		else if(format == imgux::pixel_format::nv12)
+		{
+			// OpenCV only goes as far as I420, interleave the chroma planes ourselves
+			cv::cvtColor(frame_out, frame_rot, CV_BGR2YUV_I420);
+			frame_yuv.create(frame_rot.size(), CV_8UC1);
+			
+			int w = frame_out.cols, h = frame_out.rows;
+			cv::Mat y = frame_yuv.rowRange(0, h);
+			frame_rot.rowRange(0, h).copyTo(y);
+			
+			const uchar* u = frame_rot.ptr(h);
+			const uchar* v = u + (w / 2) * (h / 2);
+			uchar* uv = frame_yuv.ptr(h);
+			for(int n = 0; n < (w / 2) * (h / 2); n++)
+			{
+				uv[2 * n] = u[n];
+				uv[2 * n + 1] = v[n];
+			}
+		}
+		
+		else if(jpeg)
+		{
+			// compressed once here, then only decoded by the stages that look at the pixels
+			span.next("imencode");
+			cv::imencode(".jpg", frame_out, jpeg_data, jpeg_params);
+			frame_yuv = cv::Mat(1, (int)jpeg_data.size(), CV_8UC1, jpeg_data.data());
+		}
 		
-		imgux::frame_write(frame_out, info);
+		span.end();
+		auto write_start = std::chrono::steady_clock::now();
+		imgux::frame_write(yuv or jpeg ? frame_yuv : frame_out, info);
+		double write_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - write_start).count();
+		write_total += write_ms;
+		write_max = std::max(write_max, write_ms);
 		
+		imgux::trace_span read_span("decode");
 		if(!(stream.read(frame)))
 		{
 			std::cerr << "stream finished\n";
@@ -107,5 +238,14 @@ int main(int argc, char** argv)
 		}
 	}
 	
+	if(replay)
+	{
+		double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		double duration = last_t + 1.0 / source_fps;
+		std::cerr << std::fixed << "videosource: replayed " << i << " frames in " << wall << "s: " << (wall > 0 ? i / wall : 0.0) << " fps, "
+			<< (wall > 0 ? duration / wall : 0.0) << "x real time; waited on the pipeline avg " << (i ? write_total / i : 0.0)
+			<< "ms max " << write_max << "ms\n";
+	}
+	
 	return 0;
 }
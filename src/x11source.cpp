@@ -0,0 +1,339 @@
+#include <imgux.hpp>
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+
+double time()
+{
+	using namespace std;
+	using namespace std::chrono;
+	
+	static high_resolution_clock::time_point start = high_resolution_clock::now();
+	high_resolution_clock::time_point now = high_resolution_clock::now();
+	
+	duration<double> time_span = duration_cast<duration<double>>(now - start);
+	
+	return time_span.count();
+}
+
+// MIT-SHM errors (e.g. a display on another machine, which can't see our segment) arrive asynchronously
+static bool shm_failed = false;
+static int shm_error_handler(Display*, XErrorEvent*)
+{
+	shm_failed = true;
+	return 0;
+}
+
+// grabs the root window into a shared memory segment, so the X server writes the pixels straight into our buffer
+struct shm_grabber
+{
+	Display* dpy = nullptr;
+	Window root;
+	XImage* image = nullptr;
+	XImage* region = nullptr; // a header over the start of the segment, for grabbing part of the screen
+	XShmSegmentInfo shminfo;
+	bool use_shm = false;
+	int width = 0, height = 0;
+	
+	bool open(Display* display)
+	{
+		dpy = display;
+		root = DefaultRootWindow(dpy);
+		
+		XWindowAttributes attr;
+		XGetWindowAttributes(dpy, root, &attr);
+		width = attr.width;
+		height = attr.height;
+		
+		if(!XShmQueryExtension(dpy))
+		{
+			std::cerr << "x11source: MIT-SHM not available, falling back to XGetImage\n";
+			return true;
+		}
+		
+		int screen = DefaultScreen(dpy);
+		image = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen), ZPixmap, nullptr, &shminfo, width, height);
+		if(!image)
+			return true;
+		
+		shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+		if(shminfo.shmid < 0)
+		{
+			XDestroyImage(image);
+			image = nullptr;
+			return true;
+		}
+		
+		shminfo.shmaddr = image->data = (char*)shmat(shminfo.shmid, nullptr, 0);
+		shminfo.readOnly = False;
+		
+		bool attached = false;
+		if(shminfo.shmaddr != (char*)-1)
+		{
+			shm_failed = false;
+			XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+			attached = XShmAttach(dpy, &shminfo);
+			XSync(dpy, False);
+			XSetErrorHandler(old_handler);
+			attached = attached and !shm_failed;
+		}
+		shmctl(shminfo.shmid, IPC_RMID, nullptr); // freed once we detach
+		
+		if(!attached)
+		{
+			std::cerr << "x11source: can't attach the shared memory segment, falling back to XGetImage\n";
+			if(shminfo.shmaddr != (char*)-1)
+				shmdt(shminfo.shmaddr);
+			image->data = nullptr;
+			XDestroyImage(image);
+			image = nullptr;
+			return true;
+		}
+		
+		use_shm = true;
+		return true;
+	}
+	
+	void close()
+	{
+		if(region)
+		{
+			region->data = nullptr;
+			XDestroyImage(region);
+			region = nullptr;
+		}
+		if(use_shm)
+		{
+			XShmDetach(dpy, &shminfo);
+			shmdt(shminfo.shmaddr);
+			image->data = nullptr;
+		}
+		if(image)
+			XDestroyImage(image);
+		image = nullptr;
+		use_shm = false;
+	}
+	
+	// returns a BGRA view over the grabbed pixels of r, only valid until the next grab
+	bool grab(const cv::Rect& r, cv::Mat& output)
+	{
+		XImage* grabbed = image;
+		
+		if(use_shm and r.size() == cv::Size(width, height))
+		{
+			if(!XShmGetImage(dpy, root, image, 0, 0, AllPlanes))
+				return false;
+		}
+		else if(use_shm)
+		{
+			// the server packs a region at the start of the segment at its own width, so it needs an image that size to describe it
+			int screen = DefaultScreen(dpy);
+			if(region)
+			{
+				region->data = nullptr;
+				XDestroyImage(region);
+			}
+			region = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen), ZPixmap, shminfo.shmaddr, &shminfo, r.width, r.height);
+			if(!region or !XShmGetImage(dpy, root, region, r.x, r.y, AllPlanes))
+				return false;
+			grabbed = region;
+		}
+		else
+		{
+			if(image)
+				XDestroyImage(image);
+			image = XGetImage(dpy, root, r.x, r.y, r.width, r.height, AllPlanes, ZPixmap);
+			if(!image)
+				return false;
+			grabbed = image;
+		}
+		
+		if(grabbed->bits_per_pixel != 32)
+		{
+			std::cerr << "x11source: error: only 32bpp displays are supported\n";
+			return false;
+		}
+		
+		output = cv::Mat(r.height, r.width, CV_8UC4, grabbed->data, grabbed->bytes_per_line);
+		return true;
+	}
+};
+
+int main(int argc, char** argv)
+{
+	imgux::arguments_add("display", "", "X display to capture, empty for $DISPLAY (e.g. :99 for an Xvfb)");
+	imgux::arguments_add("fps", "15", "Maximum frames per second to capture");
+	imgux::arguments_add("scale", "1", "Scale the image");
+	imgux::arguments_add("damage", "1", "Use XDamage to only update and report the changed regions");
+	imgux::arguments_add("max-damage-rects", "16", "Merge the damaged regions into one once there are more than this many");
+	imgux::arguments_parse(argc, argv);
+	
+	std::string display;
+	double fps, scale;
+	bool use_damage;
+	int max_rects;
+	imgux::arguments_get("display", display);
+	imgux::arguments_get("fps", fps);
+	imgux::arguments_get("scale", scale);
+	imgux::arguments_get("damage", use_damage);
+	imgux::arguments_get("max-damage-rects", max_rects);
+	
+	Display* dpy = XOpenDisplay(display == "" ? nullptr : display.c_str());
+	if(!dpy)
+	{
+		std::cerr << "x11source: can't open display " << display << "\n";
+		return 1;
+	}
+	
+	shm_grabber grabber;
+	grabber.open(dpy);
+	
+	int damage_event = 0, damage_error = 0;
+	Damage damage = 0;
+	if(use_damage and XDamageQueryExtension(dpy, &damage_event, &damage_error))
+		damage = XDamageCreate(dpy, grabber.root, XDamageReportRawRectangles);
+	else if(use_damage)
+	{
+		std::cerr << "x11source: XDamage not available, reporting full frames\n";
+		use_damage = false;
+	}
+	
+	std::string source = display == "" ? "x11" : "x11" + display;
+	std::cerr << "video source " << source << " opened (" << grabber.width << "x" << grabber.height << (grabber.use_shm ? ", shm" : "") << ")\n";
+	imgux::frame_setup();
+	
+	cv::Size targsize = cv::Size((double)grabber.width * scale, (double)grabber.height * scale);
+	cv::Rect screen(0, 0, grabber.width, grabber.height);
+	cv::Mat grabbed, frame, frame_out;
+	
+	auto interval = std::chrono::duration<double>(1.0 / fps);
+	auto next = std::chrono::steady_clock::now();
+	bool first = true;
+	size_t i = 0;
+	
+	while(true)
+	{
+		std::vector<cv::Rect> damaged;
+		bool merged = false;
+		
+		while(use_damage and XPending(dpy))
+		{
+			XEvent ev;
+			XNextEvent(dpy, &ev);
+			
+			if(ev.type != damage_event + XDamageNotify)
+				continue;
+			
+			XDamageNotifyEvent* dev = (XDamageNotifyEvent*)&ev;
+			cv::Rect r = cv::Rect(dev->area.x, dev->area.y, dev->area.width, dev->area.height) & screen;
+			
+			if(r.area() == 0)
+				continue;
+			else if(merged)
+				damaged[0] = damaged[0] | r;
+			else
+			{
+				damaged.push_back(r);
+				if(damaged.size() > (size_t)max_rects)
+				{
+					cv::Rect all = damaged[0];
+					for(const cv::Rect& d : damaged)
+						all = all | d;
+					damaged.assign(1, all);
+					merged = true;
+				}
+			}
+		}
+		
+		if(use_damage)
+			XDamageSubtract(dpy, damage, None, None);
+		
+		if(first or !use_damage or !damaged.empty())
+		{
+			imgux::trace_frame(i);
+			imgux::trace_span span("grab");
+			
+			// only grab and convert the regions that changed, the rest of the frame is still valid
+			cv::Mat& full = targsize == screen.size() ? frame_out : frame;
+			full.create(screen.size(), CV_8UC3);
+			
+			bool grabbed_ok = true;
+			for(const cv::Rect& r : first or !use_damage ? std::vector<cv::Rect>(1, screen) : damaged)
+			{
+				if(!grabber.grab(r, grabbed))
+				{
+					grabbed_ok = false;
+					break;
+				}
+				cv::Mat dst = full(r);
+				cv::cvtColor(grabbed, dst, CV_BGRA2BGR);
+			}
+			if(!grabbed_ok)
+			{
+				std::cerr << "x11source: grab failed\n";
+				break;
+			}
+			
+			if(targsize != screen.size())
+			{
+				span.next("resize");
+				cv::resize(frame, frame_out, targsize);
+			}
+		}
+		
+		double t = time();
+		std::stringstream ss;
+		ss << std::fixed << "time=" << t << ";frame=" << i++ << ";source=" << source;
+		
+		if(use_damage)
+		{
+			if(first)
+				damaged.assign(1, screen);
+			
+			ss << ";damage=";
+			const char* sep = "";
+			for(const cv::Rect& r : damaged)
+			{
+				int x = r.x * scale, y = r.y * scale;
+				cv::Rect out(x, y, std::ceil((r.x + r.width) * scale) - x, std::ceil((r.y + r.height) * scale) - y);
+				out &= cv::Rect(cv::Point(), targsize);
+				if(out.area() == 0)
+					continue;
+				ss << sep << out.x << "," << out.y << "," << out.width << "," << out.height;
+				sep = "|";
+			}
+			if(*sep == '\0' and !damaged.empty()) // all of it rounded away at the edge, but something did change
+				ss << "0,0," << targsize.width << "," << targsize.height;
+		}
+		first = false;
+		
+		imgux::frame_info info;
+		info.info = ss.str();
+		
+		imgux::frame_write(frame_out, info);
+		
+		next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+		if(next < std::chrono::steady_clock::now()) // running behind, don't try to catch up
+			next = std::chrono::steady_clock::now();
+		std::this_thread::sleep_until(next);
+	}
+	
+	if(damage)
+		XDamageDestroy(dpy, damage);
+	grabber.close();
+	XCloseDisplay(dpy);
+	
+	return 0;
+}